@@ -22,9 +22,11 @@
 
 #include <float.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <math.h>
+#include <time.h>
 
 #include "libavutil/avassert.h"
 #include "libavutil/mathematics.h"
@@ -33,10 +35,13 @@
 #include "libavutil/opt.h"
 #include "libavutil/log.h"
 #include "libavutil/fifo.h"
+#include "libavutil/time.h"
 
 #include "libavformat/avformat.h"
     
 #include "cached_segment.h"
+#include "ivr_latency.h"
+#include "cseg_spool.h"
 
 void avpriv_set_pts_info(AVStream *s, int pts_wrap_bits,
                          unsigned int pts_num, unsigned int pts_den);
@@ -84,6 +89,12 @@ void cached_segment_reset(CachedSegment * segment)
     segment->size = 0;
     segment->start_dts = AV_NOPTS_VALUE;
     segment->next_dts = AV_NOPTS_VALUE;
+    segment->open_time = 0;
+    segment->append_time = 0;
+    segment->dequeue_time = 0;
+    segment->degraded = 0;
+    segment->persist = 0;
+    segment->spooled = 0;
 }
 int write_segment(void *opaque, uint8_t *buf, int buf_size)
 {  
@@ -151,6 +162,71 @@ void free_segment_list(CachedSegmentList *seg_list)
 
 
 
+//////////////////////////
+//segment ring operation
+int init_segment_ring(CachedSegmentRing *ring, uint32_t min_size)
+{
+    uint32_t size = 1;
+    while(size < min_size){
+        size <<= 1;
+    }
+    ring->slots = av_mallocz_array(size, sizeof(CachedSegment *));
+    if(ring->slots == NULL){
+        return AVERROR(ENOMEM);
+    }
+    ring->mask = size - 1;
+    ring->head = ring->tail = 0;
+    return 0;
+}
+
+int put_segment_ring(CachedSegmentRing *ring, CachedSegment * segment)
+{
+    uint32_t tail = ring->tail;
+    if(tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask){
+        return AVERROR(ENOSPC);
+    }
+    segment->next = NULL;
+    ring->slots[tail & ring->mask] = segment;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+CachedSegment * peek_segment_ring(CachedSegmentRing *ring)
+{
+    uint32_t head = ring->head;
+    if(head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)){
+        return NULL;
+    }
+    return ring->slots[head & ring->mask];
+}
+
+CachedSegment * get_segment_ring(CachedSegmentRing *ring)
+{
+    CachedSegment * segment = peek_segment_ring(ring);
+    if(segment != NULL){
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+    return segment;
+}
+
+uint32_t segment_ring_num(CachedSegmentRing *ring)
+{
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - 
+           __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+void free_segment_ring(CachedSegmentRing *ring)
+{
+    CachedSegment * segment;
+    if(ring->slots == NULL){
+        return;
+    }
+    while((segment = get_segment_ring(ring)) != NULL){
+        cached_segment_free(segment);
+    }
+    av_freep(&ring->slots);
+}
+
 /////////////////////////////
 //writer operations 
 static CachedSegmentWriter * first_writer = NULL;
@@ -160,6 +236,109 @@ void register_segment_writer(CachedSegmentWriter * writer)
     writer->next = first_writer;
     first_writer = writer;
 }
+void cseg_stats_count_http(CachedSegmentContext *cseg, int status_code)
+{
+    int64_t *counter;
+    if(status_code <= 0){
+        counter = &cseg->stats.http_errors;
+    }else if(status_code < 300){
+        counter = &cseg->stats.http_2xx;
+    }else if(status_code < 400){
+        counter = &cseg->stats.http_3xx;
+    }else if(status_code < 500){
+        counter = &cseg->stats.http_4xx;
+    }else{
+        counter = &cseg->stats.http_5xx;
+    }
+    //called by the writer without lock
+    __sync_fetch_and_add(counter, 1);
+}
+
+int32_t cseg_writer_timeout(CachedSegmentContext *cseg, int32_t timeout)
+{
+    int64_t deadline = __atomic_load_n(&cseg->shutdown_deadline, __ATOMIC_ACQUIRE);
+    int64_t remaining;
+    
+    if(deadline == 0){
+        return timeout;
+    }
+    remaining = (deadline - av_gettime_relative()) / 1000;
+    if(remaining <= 0){
+        return AVERROR(ETIMEDOUT);
+    }
+    return (timeout <= 0 || timeout > remaining) ? (int32_t)remaining : timeout;
+}
+
+/* number of the segments waiting to be written */
+static uint32_t cached_segment_num(CachedSegmentContext *cseg)
+{
+    //backfill_num is increased before a segment leaves the ring, never undercount
+    return __atomic_load_n(&cseg->backfill_num, __ATOMIC_ACQUIRE) + 
+           segment_ring_num(&cseg->cached_ring);
+}
+
+int ffmpeg_ivr_cseg_stats(AVFormatContext *s, CachedSegmentStats *stats)
+{
+    CachedSegmentContext *cseg;
+    
+    if(s == NULL || s->oformat != &ff_cached_segment_muxer || s->priv_data == NULL){
+        return AVERROR(EINVAL);
+    }
+    cseg = (CachedSegmentContext *)s->priv_data;
+    
+    //a racy snapshot is good enough for the counters
+    memcpy(stats, &cseg->stats, sizeof(CachedSegmentStats));
+    stats->cached_segments = cached_segment_num(cseg);
+    stats->free_segments = cseg->free_list.seg_num + segment_ring_num(&cseg->free_ring);
+    stats->max_segments = cseg->max_nb_segments;
+    
+    return 0;
+}
+
+int ffmpeg_ivr_cseg_trigger(AVFormatContext *s, int active)
+{
+    CachedSegmentContext *cseg;
+    
+    if(s == NULL || s->oformat != &ff_cached_segment_muxer || s->priv_data == NULL){
+        return AVERROR(EINVAL);
+    }
+    cseg = (CachedSegmentContext *)s->priv_data;
+    
+    if(active){
+        __atomic_store_n(&cseg->event_active, 1, __ATOMIC_SEQ_CST);
+    }else if(__atomic_load_n(&cseg->event_active, __ATOMIC_SEQ_CST)){
+        //post-roll starts before the event is cleared, never a gap between them
+        __atomic_store_n(&cseg->event_stop_time, av_gettime_relative(), __ATOMIC_SEQ_CST);
+        __atomic_store_n(&cseg->event_active, 0, __ATOMIC_SEQ_CST);
+    }
+    return 0;
+}
+
+int ffmpeg_ivr_cseg_event_enabled(AVFormatContext *s)
+{
+    CachedSegmentContext *cseg;
+    
+    if(s == NULL || s->oformat != &ff_cached_segment_muxer || s->priv_data == NULL){
+        return 0;
+    }
+    cseg = (CachedSegmentContext *)s->priv_data;
+    return (cseg->flags & CSEG_FLAG_EVENT_TRIGGER) != 0;
+}
+
+/* check if the segments should be written now, always true without event_trigger */
+static int event_persisting(CachedSegmentContext *cseg)
+{
+    int64_t stop_time;
+    
+    if(!(cseg->flags & CSEG_FLAG_EVENT_TRIGGER) || 
+       __atomic_load_n(&cseg->event_active, __ATOMIC_SEQ_CST)){
+        return 1;
+    }
+    stop_time = __atomic_load_n(&cseg->event_stop_time, __ATOMIC_SEQ_CST);
+    return stop_time > 0 && 
+           av_gettime_relative() - stop_time < (int64_t)(cseg->post_roll_time * 1000000);
+}
+
 static CachedSegmentWriter *find_segment_writer(char * filename)
 {
     char hostname[1024], hoststr[1024], proto[16];
@@ -199,25 +378,37 @@ static int ff_check_interrupt(AVIOInterruptCB *cb)
 
 static CachedSegment * get_free_segment(CachedSegmentContext *cseg)
 {
-    CachedSegment * segment = NULL;
-    pthread_mutex_lock(&cseg->mutex);
-    if(cseg->free_list.seg_num > 0){
-        segment = get_segment_list(&(cseg->free_list));
-        cached_segment_reset(segment);
-    }
-    pthread_mutex_unlock(&cseg->mutex);
+    CachedSegment * segment = get_segment_list(&(cseg->free_list));
     if(segment == NULL){
+        //reuse the segment written by consumer
+        segment = get_segment_ring(&(cseg->free_ring));
+    }
+    if(segment != NULL){
+        cached_segment_reset(segment);
+    }else{
         segment = cached_segment_alloc(cseg->max_seg_size);
     }
     return segment;
 }
 
+/* called by mux thread only */
 static void recycle_free_segment(CachedSegmentContext *cseg, CachedSegment * segment)
 {
     cached_segment_reset(segment);
-    pthread_mutex_lock(&cseg->mutex);        
     put_segment_list(&(cseg->free_list), segment);        
-    pthread_mutex_unlock(&cseg->mutex);
+}
+
+/* wake up the consumer if it's sleeping, called by mux thread */
+static void wakeup_consumer(CachedSegmentContext *cseg)
+{
+    //pairs with the fence in consumer_sleep(), 
+    //either the consumer sees the new segment or we see it idle
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&cseg->consumer_idle, __ATOMIC_RELAXED)){
+        pthread_mutex_lock(&cseg->mutex);
+        pthread_cond_signal(&cseg->not_empty); //wakeup comsumer    
+        pthread_mutex_unlock(&cseg->mutex);
+    }
 }
 #define SEGMENT_HAS_DROPED   1
 /* append current segment to the cached segment list */
@@ -226,12 +417,17 @@ static int append_cur_segment(AVFormatContext *s)
     CachedSegmentContext *cseg = (CachedSegmentContext *)s->priv_data;
     CachedSegment * segment = cseg->cur_segment;
     int ret = 0;
+    int64_t append_start = 0;
     
     if(segment == NULL){
         //no current segment, just finished
         return 0;
     }
     
+    if(ivr_latency_enabled){
+        append_start = ivr_latency_now();
+    }
+    
     cseg->cur_segment = NULL;
        
     if(segment->start_ts <= 0.0 ||
@@ -241,10 +437,8 @@ static int append_cur_segment(AVFormatContext *s)
         return SEGMENT_HAS_DROPED;
     }
         
-    pthread_mutex_lock(&cseg->mutex);
     if(!(cseg->flags & CSEG_FLAG_NONBLOCK)){
-        while(cseg->cached_list.seg_num >= cseg->max_nb_segments){
-            pthread_mutex_unlock(&cseg->mutex);            
+        while(cached_segment_num(cseg) >= cseg->max_nb_segments){
             if (ff_check_interrupt(&s->interrupt_callback)){ 
                 recycle_free_segment(cseg, segment);
                 return AVERROR_EXIT;  
@@ -253,20 +447,19 @@ static int append_cur_segment(AVFormatContext *s)
                 return cseg->consumer_exit_code;
             }
             av_usleep(10000); //wait for 10ms
-            pthread_mutex_lock(&cseg->mutex);
         }  
     }//if(!(cseg->flags & CSEG_FLAG_NONBLOCK)){
         
     
-    if(cseg->cached_list.seg_num >= cseg->max_nb_segments){ 
+    if(cached_segment_num(cseg) >= cseg->max_nb_segments){ 
         av_log(s, AV_LOG_WARNING, 
                "One Segment(size:%d, start_ts:%f, duration:%f, pos:%lld, sequence:%lld) "
                "is dropped because of slow writer\n", 
                 segment->size, 
                 segment->start_ts, segment->duration, 
                 segment->pos, segment->sequence); 
-        cached_segment_reset(segment);
-        put_segment_list(&(cseg->free_list), segment);     
+        recycle_free_segment(cseg, segment);
+        __sync_fetch_and_add(&cseg->stats.segments_dropped, 1);
         ret = SEGMENT_HAS_DROPED;
     }else{
 /*
@@ -276,15 +469,286 @@ static int append_cur_segment(AVFormatContext *s)
                 segment->size, 
                 segment->start_ts, segment->duration, 
                 segment->pos, segment->sequence, 
-                cseg->cached_list.seg_num); 
+                cached_segment_num(cseg)); 
 */
-        put_segment_list(&(cseg->cached_list), segment);  
-        ret = 0;
+        if(append_start){
+            segment->append_time = ivr_latency_now();
+            ivr_latency_record(IVR_LATENCY_APPEND, segment->append_time - append_start);
+        }
+        if(segment->degraded){
+            __sync_fetch_and_add(&cseg->stats.segments_degraded, 1);
+        }
+        if((cseg->flags & CSEG_FLAG_EVENT_TRIGGER) && 
+           (segment->persist || event_persisting(cseg))){
+            __atomic_store_n(&cseg->persist_sequence, segment->sequence, __ATOMIC_RELEASE);
+        }
+        //should not be full as checked above, only this thread puts 
+        if(put_segment_ring(&(cseg->cached_ring), segment) < 0){
+            av_log(s, AV_LOG_ERROR, 
+                   "One Segment(sequence:%lld) is dropped because the cached ring is full\n", 
+                   segment->sequence);
+            recycle_free_segment(cseg, segment);
+            __sync_fetch_and_add(&cseg->stats.segments_dropped, 1);
+            ret = SEGMENT_HAS_DROPED;
+        }else{
+            ret = 0;
+        }
     }
-    pthread_cond_signal(&cseg->not_empty); //wakeup comsumer    
+    wakeup_consumer(cseg);
     
+    return ret;
+}
+
+static void record_segment_written(CachedSegment * segment)
+{
+    int64_t now;
+    if(!segment->dequeue_time){
+        return; //latency stats disabled when the segment was appended
+    }
+    now = ivr_latency_now();
+    ivr_latency_record(IVR_LATENCY_WRITE, now - segment->dequeue_time);
+    if(segment->open_time){
+        ivr_latency_record(IVR_LATENCY_SEGMENT, now - segment->open_time);
+    }
+}
+
+static void count_segment_write_time(CachedSegmentContext *cseg, int64_t write_time)
+{
+    __sync_fetch_and_add(&cseg->stats.write_time_total, write_time);
+    if(write_time > cseg->stats.write_time_max){
+        cseg->stats.write_time_max = write_time;
+    }
+}
+
+static void count_segment_written(CachedSegmentContext *cseg, CachedSegment * segment)
+{
+    record_segment_written(segment);
+    __sync_fetch_and_add(&cseg->stats.segments_written, 1);
+    __sync_fetch_and_add(&cseg->stats.bytes_written, segment->size);
+}
+
+/* give the segment back to mux thread, called by consumer */
+static void release_segment(CachedSegmentContext *cseg, CachedSegment * segment)
+{
+    cached_segment_reset(segment);
+    if(put_segment_ring(&(cseg->free_ring), segment) < 0){
+        cached_segment_free(segment);
+    }
+}
+
+/* wait for the next segment, or at most delay_ms if positive */
+static void consumer_wait(CachedSegmentContext *cseg, int delay_ms)
+{
+    struct timespec ts;
+    
+    if(delay_ms <= 0){
+        pthread_cond_wait(&(cseg->not_empty), &(cseg->mutex));
+        return;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts); // not_empty is bound to CLOCK_MONOTONIC
+    ts.tv_sec += delay_ms / 1000;
+    ts.tv_nsec += (long)(delay_ms % 1000) * 1000000;
+    if(ts.tv_nsec >= 1000000000){
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&(cseg->not_empty), &(cseg->mutex), &ts);
+}
+
+/* 
+ * move the older segments from the ring to backfill list, 
+ * only the live edge is left in the ring
+ */
+static void move_to_backfill(CachedSegmentContext *cseg)
+{
+    while(segment_ring_num(&cseg->cached_ring) > 1){
+        __atomic_add_fetch(&cseg->backfill_num, 1, __ATOMIC_RELEASE);
+        put_segment_list(&(cseg->backfill_list), get_segment_ring(&(cseg->cached_ring)));
+    }
+}
+
+/* in event_trigger mode, only the segments in or before the event are written */
+static int segment_persistable(CachedSegmentContext *cseg, CachedSegment * segment)
+{
+    return !(cseg->flags & CSEG_FLAG_EVENT_TRIGGER) ||
+           segment->sequence <= __atomic_load_n(&cseg->persist_sequence, __ATOMIC_ACQUIRE);
+}
+
+typedef enum SegmentSource {
+    SEGMENT_FROM_RING = 0,
+    SEGMENT_FROM_BACKFILL,
+    SEGMENT_FROM_SPOOL,         // saved by the previous run
+} SegmentSource;
+
+/* load the next segment spooled by the previous run, NULL if none */
+static CachedSegment * next_spooled_segment(CachedSegmentContext *cseg)
+{
+    CachedSegment * segment;
+    int ret;
+    
+    if(cseg->spool_segment != NULL || cseg->spool_dir == NULL || cseg->spool_empty){
+        return cseg->spool_segment;
+    }
+    segment = cached_segment_alloc(cseg->max_seg_size);
+    if(segment == NULL){
+        return NULL;
+    }
+    ret = cseg_spool_load(cseg->spool_dir, cseg->spool_tag, segment, 
+                          cseg->spool_path, sizeof(cseg->spool_path));
+    if(ret <= 0){
+        if(ret < 0){
+            av_log(NULL, AV_LOG_ERROR,  "[cseg] cannot load the spooled segments:%s\n", 
+                   av_err2str(ret));
+        }
+        cached_segment_free(segment);
+        cseg->spool_empty = 1;  //the spool only grows at shutdown
+        return NULL;
+    }
+    cseg->spool_segment = segment;
+    return segment;
+}
+
+/* 
+ * the next segment to write, the live edge first if fresh_first, 
+ * then the spooled ones if idle, *source is set to where it's from
+ */
+static CachedSegment * next_segment_to_write(CachedSegmentContext *cseg, SegmentSource *source)
+{
+    CachedSegment * segment;
+    
+    if(cseg->flags & CSEG_FLAG_FRESH_FIRST){
+        move_to_backfill(cseg);
+    }
+    if((segment = peek_segment_ring(&cseg->cached_ring)) != NULL && 
+       segment_persistable(cseg, segment)){
+        *source = SEGMENT_FROM_RING;
+    }else if((segment = cseg->backfill_list.first) != NULL &&
+             segment_persistable(cseg, segment)){
+        *source = SEGMENT_FROM_BACKFILL;
+    }else if(cseg->consumer_active && 
+             (segment = next_spooled_segment(cseg)) != NULL){
+        *source = SEGMENT_FROM_SPOOL;
+    }else{
+        segment = NULL; //the left ones are kept for pre-roll only
+    }
+    return segment;
+}
+
+/* remove the segment returned by next_segment_to_write() */
+static void remove_segment_to_write(CachedSegmentContext *cseg, SegmentSource source)
+{
+    if(source == SEGMENT_FROM_SPOOL){
+        cseg_spool_remove(cseg->spool_path);
+        cseg->spool_segment = NULL;
+    }else if(source == SEGMENT_FROM_BACKFILL){
+        get_segment_list(&(cseg->backfill_list));
+        __atomic_sub_fetch(&cseg->backfill_num, 1, __ATOMIC_RELEASE);
+    }else{
+        get_segment_ring(&(cseg->cached_ring));
+    }
+}
+
+CachedSegment * cseg_next_cached_segment(CachedSegmentContext *cseg, CachedSegment *segment)
+{
+    CachedSegmentRing *ring = &cseg->cached_ring;
+    uint32_t head = ring->head;     //only moved by the consumer, which is calling the writer
+    CachedSegment * next;
+    
+    if(__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head < 2 ||
+       ring->slots[head & ring->mask] != segment){
+        return NULL;
+    }
+    next = ring->slots[(head + 1) & ring->mask];
+    if(next->sequence != segment->sequence + 1 || !segment_persistable(cseg, next)){
+        return NULL;
+    }
+    return next;
+}
+
+/* 
+ * save the segments which cannot be written before the shutdown deadline 
+ * to the spool, for the next run to write
+ */
+static void spill_segments(CachedSegmentContext *cseg)
+{
+    CachedSegment * segment;
+    SegmentSource source;
+    int spilled = 0;
+    
+    if(cseg->spool_dir == NULL){
+        return;
+    }
+    while((segment = next_segment_to_write(cseg, &source)) != NULL){
+        if(cseg_spool_save(cseg->spool_dir, cseg->spool_tag, segment) < 0){
+            break;
+        }
+        remove_segment_to_write(cseg, source);
+        release_segment(cseg, segment);
+        spilled++;
+    }
+    if(spilled){
+        av_log(NULL, AV_LOG_WARNING, "[cseg] %d segments are spilled to %s\n", 
+               spilled, cseg->spool_dir);
+    }
+}
+
+/* 
+ * check if the shutdown deadline is expired, 
+ * the writer requests are limited within it by cseg_writer_timeout()
+ */
+static int shutdown_deadline_expired(CachedSegmentContext *cseg)
+{
+    return cseg_writer_timeout(cseg, 0) < 0;
+}
+
+/* 
+ * sleep until a new segment is appended, or the resume delay is expired 
+ * if the writer is paused
+ */
+static void consumer_sleep(CachedSegmentContext *cseg, int paused, int delay_ms)
+{
+    SegmentSource source;
+    //what the mux thread changes before wakeup_consumer(), taken before the check
+    uint32_t tail = __atomic_load_n(&cseg->cached_ring.tail, __ATOMIC_ACQUIRE);
+    int64_t persist_sequence = __atomic_load_n(&cseg->persist_sequence, __ATOMIC_ACQUIRE);
+    
+    //checked out of the lock, which the mux thread may wait for, 
+    //as the spool may be loaded from disk
+    if(!paused && next_segment_to_write(cseg, &source) != NULL){
+        return;
+    }
+    
+    pthread_mutex_lock(&cseg->mutex);
+    __atomic_store_n(&cseg->consumer_idle, 1, __ATOMIC_RELAXED);
+    //pairs with the fence in wakeup_consumer(), 
+    //a segment appended or an event triggered since the check is seen here
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(cseg->consumer_active && 
+       tail == __atomic_load_n(&cseg->cached_ring.tail, __ATOMIC_ACQUIRE) &&
+       persist_sequence == __atomic_load_n(&cseg->persist_sequence, __ATOMIC_ACQUIRE)){
+        consumer_wait(cseg, paused ? delay_ms : 0);
+    }
+    __atomic_store_n(&cseg->consumer_idle, 0, __ATOMIC_RELAXED);
     pthread_mutex_unlock(&cseg->mutex);
+}
+
+static int consumer_write_segment(CachedSegmentContext *cseg, CachedSegment * segment)
+{
+    int ret = 0;
     
+    if(segment->append_time && !segment->dequeue_time){
+        segment->dequeue_time = ivr_latency_now();
+        ivr_latency_record(IVR_LATENCY_QUEUE, segment->dequeue_time - segment->append_time);
+    }
+    if(cseg->writer != NULL && cseg->writer->write_segment != NULL){   
+        int64_t write_start = av_gettime_relative();
+        ret = cseg->writer->write_segment(cseg, segment);
+        count_segment_write_time(cseg, av_gettime_relative() - write_start);
+    } 
+    if(ret == 0){
+        count_segment_written(cseg, segment);
+    }
     return ret;
 }
 
@@ -293,92 +757,105 @@ static void * consumer_routine(void *arg)
     CachedSegmentContext *cseg = 
         (CachedSegmentContext *)arg;
     CachedSegment * segment = NULL;
+    SegmentSource source = SEGMENT_FROM_RING;
     int ret = 0;
    
+    //look up the start dts for dts correction, 
+    //the mux thread holds the packets in the meanwhile
+    if(cseg->writer->get_next_dts){
+        int64_t next_dts = AV_NOPTS_VALUE;
+        if(cseg->writer->get_next_dts(cseg, &next_dts) < 0){
+            next_dts = AV_NOPTS_VALUE; //dts correction disabled
+        }
+        cseg->next_dts_seed = next_dts;
+        __atomic_store_n(&cseg->next_dts_ready, 1, __ATOMIC_RELEASE);
+    }
     
-    pthread_mutex_lock(&cseg->mutex);
     while(cseg->consumer_active){
         int keep_seg_num = 0;         
+        int paused = 0;
+        int backoff = 0;
+        int resume_delay = 0;
         
-        //try write out all segment in cached list
-        while((segment = cseg->cached_list.first) != NULL){            
-            ret = 0;
-            if(cseg->writer != NULL && cseg->writer->write_segment != NULL){   
-                pthread_mutex_unlock(&cseg->mutex);
-                //because there is only one comsumer, the first segment is safe to access without lock
-                ret = cseg->writer->write_segment(cseg, segment);
-                pthread_mutex_lock(&cseg->mutex);
-            } 
+        //try write out all segment in cached ring, backfill list and spool
+        while((segment = next_segment_to_write(cseg, &source)) != NULL){            
+            //the segment stays in the ring (or backfill list/spool) until written, 
+            //only the consumer can get it, so it's safe to access
+            ret = consumer_write_segment(cseg, segment);
             if(ret == 0){
-                //successful
-                
-                //remove the segment from cached list
-                segment = get_segment_list(&(cseg->cached_list));                
-                cached_segment_reset(segment);          
-                put_segment_list(&(cseg->free_list), segment);                        
+                //successful, remove the segment
+                remove_segment_to_write(cseg, source);
+                release_segment(cseg, segment);
                 
-            }else if(ret == 1){
-                //should keep in fifo
+            }else if(ret == CSEG_WRITER_PAUSE || ret == CSEG_WRITER_BACKOFF){
+                //should keep in fifo, retry after the writer's hint or the resume interval
+                paused = 1;
+                backoff = (ret == CSEG_WRITER_BACKOFF);
+                resume_delay = cseg->writer_resume_hint > 0 ? 
+                               cseg->writer_resume_hint : cseg->writer_resume_interval;
+                cseg->writer_resume_hint = 0;
                 break;
             }else if(ret < 0){
                 //error     
-                pthread_mutex_unlock(&cseg->mutex);
                 cseg->consumer_exit_code = ret;
                 pthread_exit(NULL);     
             }else{
                 //not support other ret code, consider error
-                pthread_mutex_unlock(&cseg->mutex);
                 av_log(NULL, AV_LOG_ERROR,  "[cseg] cannot support the writer return code:%d\n", ret);        
                 cseg->consumer_exit_code = AVERROR(EINVAL);
                 pthread_exit(NULL); 
             }
-        }// while((segment = cseg->cached_list.first) != NULL){
+        }// while((segment = next_segment_to_write(cseg, &source)) != NULL){
         
-        //clean up the expired segments
+        //clean up the expired segments, the oldest first. 
+        //During an outage the backlog is kept to retry, 
+        //bounded by cseg_list_size on append
         keep_seg_num = MIN((uint32_t)ceil(cseg->pre_recoding_time / cseg->time), 
                             cseg->max_nb_segments - 1);    
-        while(cseg->cached_list.seg_num > keep_seg_num){
-            //remove the segment from cached list
-            segment = get_segment_list(&(cseg->cached_list));                
-            cached_segment_reset(segment);          
-            put_segment_list(&(cseg->free_list), segment);              
-        }//while(cseg->cached_list.seg_num > keep_seg_num){
-            
-        if(cseg->consumer_active){
-            pthread_cond_wait(&(cseg->not_empty), &(cseg->mutex)); //wait for next time
+        while(!backoff && 
+              cseg->backfill_list.seg_num + segment_ring_num(&cseg->cached_ring) > keep_seg_num){
+            if(cseg->backfill_list.first != NULL){
+                segment = cseg->backfill_list.first;
+                remove_segment_to_write(cseg, SEGMENT_FROM_BACKFILL);
+            }else{
+                segment = get_segment_ring(&(cseg->cached_ring));                
+            }
+            release_segment(cseg, segment);
         }
+            
+        consumer_sleep(cseg, paused, resume_delay); //wait for next time
         
     }//while(cseg->consumer_active){
-    pthread_mutex_unlock(&cseg->mutex);
     
-    //flush all the cached segment 
-    //because cseg->consumer_active is 0 which means no producer existed now, 
-    //we don't need lock any more
-    while((segment = get_segment_list(&(cseg->cached_list))) != NULL){
-        //call writer's method
-        ret = 0;
-        if(cseg->writer != NULL && cseg->writer->write_segment != NULL){                    
-            ret = cseg->writer->write_segment(cseg, segment);
+    //flush all the cached segment within the shutdown deadline
+    //because cseg->consumer_active is 0 which means no producer existed now
+    while((segment = next_segment_to_write(cseg, &source)) != NULL){
+        if(shutdown_deadline_expired(cseg)){
+            av_log(NULL, AV_LOG_WARNING, "[cseg] shutdown deadline expired\n");
+            break;
         }
-        cached_segment_reset(segment);          
-        put_segment_list(&(cseg->free_list), segment);         
-        
-        if(ret < 0){
+        //call writer's method
+        ret = consumer_write_segment(cseg, segment);
+        if(ret == CSEG_WRITER_PAUSE || ret == CSEG_WRITER_BACKOFF){
+            //should keep in fifo  
+            break;
+        }else if(ret == 0){
+            //successful
+            remove_segment_to_write(cseg, source);
+            release_segment(cseg, segment);
+        }else if(ret < 0){
             //error  
             cseg->consumer_exit_code = ret;
             break;                
-        }else if(ret == 0){
-            //successful
-            
-        }else if(ret == 1){
-            //should keep in fifo  
-            break;
         }else{
             cseg->consumer_exit_code = AVERROR(EINVAL);
             break;   
         }
     }
     
+    //the left ones are written by the next run
+    spill_segments(cseg);
+    
     return NULL;    
 }
 
@@ -447,6 +924,13 @@ static int cseg_start(AVFormatContext *s)
     cseg->cur_segment = segment;
     cseg->number++;   
     segment->sequence = cseg->sequence++;
+    segment->degraded = cseg->degraded;
+    if(cseg->flags & CSEG_FLAG_EVENT_TRIGGER){
+        segment->persist = event_persisting(cseg);
+    }
+    if(ivr_latency_enabled){
+        segment->open_time = ivr_latency_now();
+    }
 
     if (oc->oformat->priv_class && oc->priv_data)
         av_opt_set(oc->priv_data, "mpegts_flags", "resend_headers", 0);
@@ -454,8 +938,78 @@ static int cseg_start(AVFormatContext *s)
     return 0;
 }
 
+/* 
+ * rebuild the inner muxer with the current codec parameters and 
+ * start a new segment on it, the old inner muxer must have been finished
+ */
+static int cseg_mux_reinit(AVFormatContext *s)
+{
+    CachedSegmentContext *cseg = s->priv_data;
+    AVDictionary *options = NULL;
+    int ret;
+
+    avformat_free_context(cseg->avf);
+    cseg->avf = NULL;
+
+    if ((ret = cseg_mux_init(s)) < 0)
+        goto fail;
+
+    if ((ret = cseg_start(s)) < 0)
+        goto fail;
+
+    av_dict_copy(&options, cseg->format_options, 0);
+    ret = avformat_write_header(cseg->avf, &options);
+    av_dict_free(&options);
+    if (ret < 0)
+        goto fail;
+
+    return 0;
+
+fail:
+    // the half-built muxer is never used
+    if (cseg->avf) {
+        av_freep(&cseg->avf->pb);
+        avformat_free_context(cseg->avf);
+        cseg->avf = NULL;
+    }
+    if (cseg->cur_segment) {
+        recycle_free_segment(cseg, cseg->cur_segment);
+        cseg->cur_segment = NULL;
+    }
+    av_log(s, AV_LOG_ERROR, "Rebuild the inner muxer failed\n");
+    return ret;
+}
+
 
 
+
+/* parse the ramp-up schedule, e.g. "2,4" for the first segment of 2 seconds, then 4 seconds */
+static int parse_ramp_up(AVFormatContext *s)
+{
+    CachedSegmentContext *cseg = s->priv_data;
+    const char *p = cseg->ramp_up_str;
+    int64_t end_time = 0;
+    
+    cseg->nb_ramp_up = 0;
+    while(p != NULL && *p){
+        char *tail;
+        double duration = strtod(p, &tail);
+        if(tail == p || duration <= 0.0 || 
+           (*tail && *tail != ',' && *tail != '|')){
+            av_log(s, AV_LOG_ERROR, "Invalid ramp-up schedule '%s'\n", cseg->ramp_up_str);
+            return AVERROR(EINVAL);
+        }
+        if(cseg->nb_ramp_up >= CSEG_MAX_RAMP_UP){
+            av_log(s, AV_LOG_ERROR, "Too many ramp-up segments, at most %d\n", CSEG_MAX_RAMP_UP);
+            return AVERROR(EINVAL);
+        }
+        end_time += (int64_t)(duration * AV_TIME_BASE);
+        cseg->ramp_up_end[cseg->nb_ramp_up++] = end_time;
+        p = *tail ? tail + 1 : tail;
+    }
+    return 0;
+}
+
 static int cseg_write_header(AVFormatContext *s)
 {
     CachedSegmentContext *cseg = s->priv_data;
@@ -466,8 +1020,16 @@ static int cseg_write_header(AVFormatContext *s)
     CachedSegmentWriter * writer;
     
     pthread_mutex_init(&cseg->mutex, NULL);
-    pthread_cond_init(&cseg->not_empty, NULL);
+    {
+        //the timed wait of consumer should not be affected by the system time change
+        pthread_condattr_t cond_attr;
+        pthread_condattr_init(&cond_attr);
+        pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&cseg->not_empty, &cond_attr);
+        pthread_condattr_destroy(&cond_attr);
+    }
     cseg->sequence       = cseg->start_sequence;
+    cseg->persist_sequence = cseg->start_sequence - 1; //nothing to write before an event
     cseg->recording_time = cseg->time * AV_TIME_BASE;
     cseg->start_dts = AV_NOPTS_VALUE;
     cseg->start_pos = 0;
@@ -475,6 +1037,7 @@ static int cseg_write_header(AVFormatContext *s)
     cseg->consumer_exit_code = 0;
     cseg->correct_delta = AV_NOPTS_VALUE;
     cseg->correct_start_dts = AV_NOPTS_VALUE;
+    cseg->next_dts_seed = AV_NOPTS_VALUE;
 
     if (cseg->format_options_str) {
         ret = av_dict_parse_string(&cseg->format_options, cseg->format_options_str, "=", ":", 0);
@@ -484,8 +1047,15 @@ static int cseg_write_header(AVFormatContext *s)
             goto fail;
         }
     }
+    
+    if ((ret = parse_ramp_up(s)) < 0)
+        goto fail;
 
+    cseg->video_index = -1;
     for (i = 0; i < s->nb_streams; i++) {
+        if (s->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO &&
+            (cseg->primary_video < 0 ? cseg->video_index < 0 : cseg->primary_video == i))
+            cseg->video_index = i;
         cseg->has_video +=
             s->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO;
         cseg->has_subtitle +=
@@ -494,10 +1064,16 @@ static int cseg_write_header(AVFormatContext *s)
             s->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO;
     }
 
+    if (cseg->has_video && cseg->video_index < 0) {
+        av_log(s, AV_LOG_ERROR,
+               "Primary video stream %d is not a video stream\n", cseg->primary_video);
+        ret = AVERROR(EINVAL);
+        goto fail;
+    }
     if (cseg->has_video > 1)
-        av_log(s, AV_LOG_WARNING,
-               "More than a single video stream present, "
-               "expect issues decoding it.\n");
+        av_log(s, AV_LOG_INFO,
+               "%d video streams present, split on the key frames of stream %d\n",
+               cseg->has_video, cseg->video_index);
     if(cseg->has_subtitle){
         av_log(s, AV_LOG_ERROR,
                "Not support subtitle stream\n");    
@@ -519,6 +1095,40 @@ static int cseg_write_header(AVFormatContext *s)
         ret = AVERROR_INVALIDDATA;
         goto fail;          
     }
+    
+    if(cseg->degrade_threshold > 0 &&
+       (cseg->degrade_resume >= cseg->degrade_threshold || 
+        cseg->degrade_threshold > cseg->max_nb_segments)){
+        //otherwise the mode would flip (and split) at every key frame, or never be degraded
+        av_log(s, AV_LOG_ERROR,
+               "cseg_degrade_resume(%d) must be less than cseg_degrade_threshold(%d), "
+               "which cannot exceed cseg_list_size(%d)\n", 
+               cseg->degrade_resume, cseg->degrade_threshold, cseg->max_nb_segments);
+        ret = AVERROR(EINVAL);
+        goto fail;
+    }
+    
+    if(cseg->target_size > 0 && (cseg->flags & CSEG_FLAG_ALIGN_TIME)){
+        av_log(s, AV_LOG_WARNING,
+               "align_time flag is ignored when split by size\n");
+    }
+    if(cseg->target_size > 0){
+        //leave room for the bytes until the next key frame
+        cseg->split_size = FFMIN(cseg->target_size, cseg->max_seg_size / 4 * 3);
+        if(cseg->split_size < cseg->target_size){
+            av_log(s, AV_LOG_WARNING,
+                   "segment target size is limited to %d bytes by cseg_seg_size\n", 
+                   cseg->split_size);
+        }
+        cseg->min_recording_time = cseg->min_time * AV_TIME_BASE;
+        cseg->max_recording_time = (cseg->max_time > 0 ? cseg->max_time : cseg->time) * AV_TIME_BASE;
+        if(cseg->min_recording_time > cseg->max_recording_time){
+            av_log(s, AV_LOG_ERROR,
+                   "segment min time cannot be greater than its max time\n");    
+            ret = AVERROR(EINVAL);
+            goto fail;   
+        }
+    }
 
     cseg->oformat = av_guess_format("mpegts", NULL, NULL);
     if (!cseg->oformat) {
@@ -527,13 +1137,18 @@ static int cseg_write_header(AVFormatContext *s)
     }
 
     cseg->filename = av_strdup(s->filename);
+    cseg->spool_tag = cseg_spool_tag(s->filename);
     cseg->out_buffer = av_malloc(SEGMENT_IO_BUFFER_SIZE);
-    init_segment_list(&cseg->cached_list);
-    init_segment_list(&cseg->free_list);   
     cseg->last_mux_dts = (int64_t *)av_malloc(sizeof(int64_t) * s->nb_streams);
     for (i = 0; i < s->nb_streams; i++) {
         cseg->last_mux_dts[i] = AV_NOPTS_VALUE;
     }
+    init_segment_list(&cseg->free_list);   
+    init_segment_list(&cseg->backfill_list);
+    //the segments in circulation: the cached ones, the current one and the one in writing
+    if ((ret = init_segment_ring(&cseg->cached_ring, cseg->max_nb_segments)) < 0 ||
+        (ret = init_segment_ring(&cseg->free_ring, cseg->max_nb_segments + 2)) < 0)
+        goto fail;
 
     if ((ret = cseg_mux_init(s)) < 0)
         goto fail;
@@ -579,6 +1194,8 @@ static int cseg_write_header(AVFormatContext *s)
             goto fail;
         }
     }   
+    //the consumer looks up the start dts before writing any segment
+    cseg->holding_pkts = cseg->writer->get_next_dts != NULL;
     
     //successful write header, start consumer
     cseg->consumer_active = 1;
@@ -621,6 +1238,9 @@ fail:
             av_freep(&cseg->last_mux_dts);
         }
         
+        free_segment_ring(&cseg->cached_ring);
+        free_segment_ring(&cseg->free_ring);
+        
         av_freep(&cseg->filename);
         
         if(cseg->format_options){
@@ -637,22 +1257,23 @@ static int cseg_ff_write_chained(AVFormatContext *dst, int dst_stream, AVPacket
                      AVFormatContext *src, int interleave)
 {
     AVPacket local_pkt;
+    AVRational src_tb = src->streams[pkt->stream_index]->time_base;
+    AVRational dst_tb = dst->streams[dst_stream]->time_base;
     int ret;
 
     local_pkt = *pkt;
     local_pkt.stream_index = dst_stream;
-    if (pkt->pts != AV_NOPTS_VALUE)
-        local_pkt.pts = av_rescale_q(pkt->pts,
-                                     src->streams[pkt->stream_index]->time_base,
-                                     dst->streams[dst_stream]->time_base);
-    if (pkt->dts != AV_NOPTS_VALUE)
-        local_pkt.dts = av_rescale_q(pkt->dts,
-                                     src->streams[pkt->stream_index]->time_base,
-                                     dst->streams[dst_stream]->time_base);
-    if (pkt->duration)
-        local_pkt.duration = av_rescale_q(pkt->duration,
-                                          src->streams[pkt->stream_index]->time_base,
-                                          dst->streams[dst_stream]->time_base);
+    
+    //the outer stream time base has been set to the inner one in write_header, 
+    //so rescaling is normally not needed
+    if (src_tb.num != dst_tb.num || src_tb.den != dst_tb.den){
+        if (pkt->pts != AV_NOPTS_VALUE)
+            local_pkt.pts = av_rescale_q(pkt->pts, src_tb, dst_tb);
+        if (pkt->dts != AV_NOPTS_VALUE)
+            local_pkt.dts = av_rescale_q(pkt->dts, src_tb, dst_tb);
+        if (pkt->duration)
+            local_pkt.duration = av_rescale_q(pkt->duration, src_tb, dst_tb);
+    }
   
     if (interleave) ret = av_interleaved_write_frame(dst, &local_pkt);
     else            ret = av_write_frame(dst, &local_pkt);
@@ -666,15 +1287,135 @@ static int cseg_ff_write_chained(AVFormatContext *dst, int dst_stream, AVPacket
 }
 
 
-static int cseg_write_packet(AVFormatContext *s, AVPacket *pkt)
+/* 
+ * switch the recording mode according to the backlog of writer, 
+ * return 1 if switched
+ */
+static int update_degraded_mode(AVFormatContext *s)
+{
+    CachedSegmentContext *cseg = (CachedSegmentContext *)s->priv_data;
+    uint32_t backlog = cached_segment_num(cseg);
+    
+    if(!cseg->degraded && backlog >= cseg->degrade_threshold){
+        av_log(s, AV_LOG_WARNING, 
+               "writer falls behind (%u segments cached), record key frames only\n", backlog);
+        cseg->degraded = 1;
+        return 1;
+    }else if(cseg->degraded && backlog <= cseg->degrade_resume){
+        av_log(s, AV_LOG_INFO, 
+               "writer catches up (%u segments cached), resume full-rate recording\n", backlog);
+        cseg->degraded = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* follow the event state set by ffmpeg_ivr_cseg_trigger() */
+static void update_event_state(AVFormatContext *s)
+{
+    CachedSegmentContext *cseg = (CachedSegmentContext *)s->priv_data;
+    int active = __atomic_load_n(&cseg->event_active, __ATOMIC_RELAXED);
+    
+    if(active == cseg->event_started){
+        return;
+    }
+    cseg->event_started = active;
+    if(active){
+        av_log(s, AV_LOG_INFO, "event triggered, write the cached segments\n");
+        //the current segment and the cached ones (pre-roll) should be written
+        cseg->cur_segment->persist = 1;
+        __atomic_store_n(&cseg->persist_sequence, cseg->cur_segment->sequence - 1, __ATOMIC_RELEASE);
+        wakeup_consumer(cseg);
+    }else{
+        av_log(s, AV_LOG_INFO, "event stopped, go on writing for %.3f seconds\n", 
+               cseg->post_roll_time);
+    }
+}
+
+/* 
+ * end time of the segment number from the start, in 1/AV_TIME_BASE sec, 
+ * the ramp-up segments are followed by the ones of recording_time
+ */
+static int64_t segment_end_time(CachedSegmentContext *cseg, unsigned number)
+{
+    if(number <= cseg->nb_ramp_up){
+        return cseg->ramp_up_end[number - 1];
+    }
+    return (cseg->nb_ramp_up ? cseg->ramp_up_end[cseg->nb_ramp_up - 1] : 0) + 
+           cseg->recording_time * (number - cseg->nb_ramp_up);
+}
+
+/* replace the extradata of codec, which the inner muxer is rebuilt with */
+static int update_extradata(AVCodecContext *codec, const uint8_t *data, int size)
+{
+    uint8_t *extradata = av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!extradata)
+        return AVERROR(ENOMEM);
+    memcpy(extradata, data, size);
+    av_freep(&codec->extradata);
+    codec->extradata      = extradata;
+    codec->extradata_size = size;
+    return 0;
+}
+
+/* check if the current segment should end at the key frame pkt */
+static int cseg_should_split(AVFormatContext *s, AVStream *st, AVPacket *pkt)
+{
+    CachedSegmentContext *cseg = (CachedSegmentContext *)s->priv_data;
+    int64_t duration, max_duration, size;
+    
+    if(cseg->target_size <= 0 && 
+       (cseg->flags & CSEG_FLAG_ALIGN_TIME) && cseg->number > cseg->nb_ramp_up){
+        //split by time, the boundaries are the wall-clock multiples of recording_time
+        int64_t seg_start = (int64_t)(cseg->cur_segment->start_ts * AV_TIME_BASE);
+        int64_t now = (int64_t)(cseg->start_ts * AV_TIME_BASE) + 
+                      av_rescale_q(pkt->dts - cseg->start_dts, st->time_base, AV_TIME_BASE_Q);
+        return now >= (seg_start / cseg->recording_time + 1) * cseg->recording_time;
+    }else if(cseg->target_size <= 0){
+        //split by time, the boundaries are the multiples of recording_time from the start
+        return av_compare_ts(pkt->dts - cseg->start_dts, st->time_base,
+                             segment_end_time(cseg, cseg->number), AV_TIME_BASE_Q) >= 0;
+    }
+    
+    //split by size, bounded by min/max time, the ramp-up segments are bounded by their time
+    duration = av_rescale_q(pkt->dts - cseg->cur_segment->start_dts, 
+                            st->time_base, AV_TIME_BASE_Q);
+    max_duration = cseg->max_recording_time;
+    if(cseg->number <= cseg->nb_ramp_up){
+        max_duration = FFMIN(max_duration, segment_end_time(cseg, cseg->number) - 
+                             (cseg->number > 1 ? segment_end_time(cseg, cseg->number - 1) : 0));
+    }
+    if(duration >= max_duration){
+        return 1;
+    }else if(duration < cseg->min_recording_time){
+        return 0;
+    }
+    size = cseg->avf->pb ? avio_tell(cseg->avf->pb) : cseg->cur_segment->size;
+    return size >= cseg->split_size;
+}
+
+/* check if the packet should be dropped in the degraded segment */
+static int degraded_drop_packet(CachedSegmentContext *cseg, AVStream *st, AVPacket *pkt)
+{
+    switch(st->codec->codec_type){
+    case AVMEDIA_TYPE_VIDEO:
+        return !(pkt->flags & AV_PKT_FLAG_KEY);
+    case AVMEDIA_TYPE_AUDIO:
+        return !(cseg->flags & CSEG_FLAG_DEGRADE_AUDIO);
+    default:
+        return 0;
+    }
+}
+
+static int cseg_mux_packet(AVFormatContext *s, AVPacket *pkt)
 {
     CachedSegmentContext *cseg = (CachedSegmentContext *)s->priv_data;
     AVFormatContext *oc = cseg->avf;
     AVStream *st = s->streams[pkt->stream_index];
     int64_t * last_mux_dts = cseg->last_mux_dts + pkt->stream_index;
-    int64_t end_pts = cseg->recording_time * cseg->number;
     int is_ref_pkt = 1;
     int ret, can_split = 1;
+    int force_split = 0, should_split = 0;
     int stream_index = 0;
 
     stream_index = pkt->stream_index;
@@ -695,16 +1436,24 @@ static int cseg_write_packet(AVFormatContext *s, AVPacket *pkt)
         return AVERROR_EXIT;
     }
     
-    //terminated if extradata has been changed
+    if(cseg->flags & CSEG_FLAG_EVENT_TRIGGER){
+        update_event_state(s);
+    }
+    
+    //start a new segment if extradata has been changed
     if(pkt->flags & AV_PKT_FLAG_KEY){
         int side_size = 0;
         uint8_t * side = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &side_size);
         if(side != NULL){
             if(side_size != st->codec->extradata_size || 
                memcmp(side, st->codec->extradata, side_size) != 0){
-                av_log(s, AV_LOG_ERROR, 
-                        "Not suppot for extradata change when recording mpegts\n");      
-                return AVERROR_EXIT;
+                av_log(s, AV_LOG_WARNING, 
+                        "Extradata of stream %d changed, start a new segment at the next split point\n",
+                        pkt->stream_index);
+                ret = update_extradata(st->codec, side, side_size);
+                if(ret < 0)
+                    return ret;
+                cseg->mux_reinit = 1;
             }
         }//if(side != NULL)
     }//if(pkt->flags & AV_PKT_FLAG_KEY)
@@ -722,9 +1471,9 @@ static int cseg_write_packet(AVFormatContext *s, AVPacket *pkt)
     
 
     if (cseg->start_dts == AV_NOPTS_VALUE) {
-        //check if the first packet must be the key video frame
+        //check if the first packet must be the key frame of the primary video
         if(cseg->has_video){
-            if(st->codec->codec_type != AVMEDIA_TYPE_VIDEO ||
+            if(pkt->stream_index != cseg->video_index ||
                 (pkt->flags & AV_PKT_FLAG_KEY) == 0){
                 //drop the audio frame or non-key video frame
                 return 0;
@@ -747,7 +1496,14 @@ static int cseg_write_packet(AVFormatContext *s, AVPacket *pkt)
         }
 
         //start_pts is ready, check start_ts
-        if(cseg->start_ts < 0.0){
+        if(cseg->start_ts < 0.0 && cseg->hold_ts > 0.0){
+            //the packet was held for the start dts, take the time it arrived
+            int64_t raw_dts = pkt->dts - 
+                (cseg->correct_delta != AV_NOPTS_VALUE ? cseg->correct_delta : 0);
+            cseg->start_ts = cseg->hold_ts + 
+                (av_rescale_q(raw_dts, st->time_base, AV_TIME_BASE_Q) - cseg->hold_dts) / 
+                (double)AV_TIME_BASE;
+        }else if(cseg->start_ts < 0.0){
             //get current time for start ts
             struct timeval tv;
             gettimeofday(&tv, NULL);
@@ -796,22 +1552,45 @@ static int cseg_write_packet(AVFormatContext *s, AVPacket *pkt)
         }
     }
     (*last_mux_dts) = pkt->dts;
-    
    
     if (cseg->has_video) {
-        can_split = st->codec->codec_type == AVMEDIA_TYPE_VIDEO &&
+        can_split = pkt->stream_index == cseg->video_index &&
                     pkt->flags & AV_PKT_FLAG_KEY;
-        is_ref_pkt = st->codec->codec_type == AVMEDIA_TYPE_VIDEO;
+        is_ref_pkt = pkt->stream_index == cseg->video_index;
     }
     
     if (pkt->dts == AV_NOPTS_VALUE)
         is_ref_pkt = can_split = 0;
+    
+    // switch the recording mode at a key frame, 
+    // a segment is either degraded or full-rate
+    if (can_split && cseg->has_video && cseg->degrade_threshold > 0 &&
+        update_degraded_mode(s)){
+        if(pkt->dts == cseg->cur_segment->start_dts){
+            cseg->cur_segment->degraded = cseg->degraded; //nothing recorded yet
+        }else{
+            force_split = 1;
+        }
+    }
+
+    // the new codec parameters take effect from the next split point 
+    // (the key frame of the primary video if any), 
+    // the segment already muxed with the old ones is closed
+    if (cseg->mux_reinit && can_split){
+        force_split = 1;
+    }
 
-    if (can_split && av_compare_ts(pkt->dts - cseg->start_dts, st->time_base,
-                                   end_pts, AV_TIME_BASE_Q) >= 0) {
+    if (can_split)
+        should_split = cseg_should_split(s, st, pkt);
+    
+    if (can_split && (force_split || should_split)) {
         int64_t cur_segment_size = 0;
         int64_t cur_segment_start_dts;
-        av_write_frame(oc, NULL); /* Flush any buffered data */
+        if(cseg->mux_reinit){
+            av_write_trailer(oc); /* Flush and release the inner muxer */
+        }else{
+            av_write_frame(oc, NULL); /* Flush any buffered data */
+        }
 /*        
         printf("pts:%lld, start_pts:%lld, end_pts:%lld, split_end_pts:%lld\n",
                (long long)pkt->pts, (long long)cseg->start_pts, (long long)cseg->end_pts, (long long)end_pts);
@@ -835,30 +1614,56 @@ static int cseg_write_packet(AVFormatContext *s, AVPacket *pkt)
             return ret;   
         else if(ret == SEGMENT_HAS_DROPED && cseg->correct_delta != AV_NOPTS_VALUE){
             //if the segment has been droped, start new segment with its timestamp
-            cseg->correct_delta += cur_segment_start_dts - pkt->dts;
+            int64_t rewind = pkt->dts - cur_segment_start_dts;
+            int i;
+            cseg->correct_delta -= rewind;
             if(pkt->pts != AV_NOPTS_VALUE){
-                pkt->pts += cur_segment_start_dts - pkt->dts;        
+                pkt->pts -= rewind;        
             }  
             pkt->dts = cur_segment_start_dts;
+            //the dropped timestamps have been seen by the dts correction and the inner muxer,
+            //forget them so that the rewound ones are not bumped or rejected as non-monotonous
+            if(rewind > 0){
+                for(i = 0; i < s->nb_streams; i++){
+                    cseg->last_mux_dts[i] = AV_NOPTS_VALUE;
+                }
+                for(i = 0; i < oc->nb_streams; i++){
+                    oc->streams[i]->cur_dts = AV_NOPTS_VALUE;
+                }
+                (*last_mux_dts) = pkt->dts;
+            }
         }
         cseg->start_pos += cur_segment_size;       
        
         //init new segment
-        ret = cseg_start(s);
+        if(cseg->mux_reinit){
+            cseg->mux_reinit = 0;
+            ret = cseg_mux_reinit(s);
+        }else{
+            ret = cseg_start(s);
+        }
         if (ret < 0)
             return ret;
+        oc = cseg->avf;
+        if(force_split && !should_split){
+            cseg->number--; //keep the boundaries of the following segments
+        }
         cseg->cur_segment->start_ts = ((double)(pkt->dts - cseg->start_dts))
                                             * st->time_base.num / st->time_base.den + cseg->start_ts;        
         cseg->cur_segment->pos = cseg->start_pos;
         cseg->cur_segment->start_dts = pkt->dts;
         cseg->cur_segment->duration = 0.0;
         
-    }//if (can_split && av_compare_ts(pkt->pts - cseg->start_pts, st->time_base,
+    }//if (can_split && (force_split || should_split)) {
     
-    ret = cseg_ff_write_chained(oc, stream_index, pkt, s, 0);
-    if(ret < 0){
-        av_log(s, AV_LOG_ERROR, "Write packet failed\n");
-        return ret;
+    if(!cseg->cur_segment->degraded || !degraded_drop_packet(cseg, st, pkt)){
+        ret = cseg_ff_write_chained(oc, stream_index, pkt, s, 0);
+        if(ret < 0){
+            av_log(s, AV_LOG_ERROR, "Write packet failed\n");
+            return ret;
+        }
+    }else{
+        ret = 0;
     }
     
     //after writing packet, update the duration for current segment
@@ -878,15 +1683,121 @@ static int cseg_write_packet(AVFormatContext *s, AVPacket *pkt)
     return ret;
 }
 
+static int hold_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    CachedSegmentContext *cseg = s->priv_data;
+    AVPacketList *pkt_node = av_mallocz(sizeof(AVPacketList));
+    int ret;
+    
+    if(!pkt_node)
+        return AVERROR(ENOMEM);
+    if((ret = av_packet_ref(&pkt_node->pkt, pkt)) < 0){
+        av_free(pkt_node);
+        return ret;
+    }
+    if(cseg->hold_ts <= 0.0 && pkt->dts != AV_NOPTS_VALUE){
+        //the wall-clock start time is derived from it when the packets are muxed
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        if(tv.tv_sec >= 31536000){  //otherwise invalid, checked on mux
+            cseg->hold_ts = (double)tv.tv_sec + ((double)tv.tv_usec) / 1000000.0;
+            cseg->hold_dts = av_rescale_q(pkt->dts, s->streams[pkt->stream_index]->time_base, 
+                                          AV_TIME_BASE_Q);
+        }
+    }
+    if(cseg->pending_end)
+        cseg->pending_end->next = pkt_node;
+    else
+        cseg->pending_pkts = pkt_node;
+    cseg->pending_end = pkt_node;
+    cseg->nb_pending_pkts++;
+    return 0;
+}
+
+static void free_pending_packets(CachedSegmentContext *cseg)
+{
+    while(cseg->pending_pkts){
+        AVPacketList *pkt_node = cseg->pending_pkts;
+        cseg->pending_pkts = pkt_node->next;
+        av_packet_unref(&pkt_node->pkt);
+        av_free(pkt_node);
+    }
+    cseg->pending_end = NULL;
+    cseg->nb_pending_pkts = 0;
+}
+
+/*
+ * hold the packets until the consumer has looked up the start dts,
+ * then apply the dts correction and mux all the held packets in order.
+ * pkt is NULL to stop holding on trailer
+ */
+static int cseg_hold_or_mux_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    CachedSegmentContext *cseg = s->priv_data;
+    int ret = 0;
+    
+    if(cseg->holding_pkts){
+        if(__atomic_load_n(&cseg->next_dts_ready, __ATOMIC_ACQUIRE)){
+            cseg->correct_start_dts = cseg->next_dts_seed;
+        }else if(pkt != NULL && cseg->consumer_exit_code == 0 &&
+                 cseg->nb_pending_pkts < CSEG_MAX_PENDING_PKTS){
+            return hold_packet(s, pkt);
+        }else{
+            av_log(s, AV_LOG_WARNING, 
+                   "Start dts is not looked up in time, dts correction disabled\n");
+        }
+        cseg->holding_pkts = 0;
+        
+        while(cseg->pending_pkts){
+            AVPacketList *pkt_node = cseg->pending_pkts;
+            cseg->pending_pkts = pkt_node->next;
+            cseg->nb_pending_pkts--;
+            ret = cseg_mux_packet(s, &pkt_node->pkt);
+            av_packet_unref(&pkt_node->pkt);
+            av_free(pkt_node);
+            if(ret < 0){
+                free_pending_packets(cseg);
+                return ret;
+            }
+        }
+        cseg->pending_end = NULL;
+    }
+    
+    if(pkt == NULL)
+        return 0;
+    return cseg_mux_packet(s, pkt);
+}
+
+static int cseg_write_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    int64_t start;
+    int ret;
+    
+    if(!ivr_latency_enabled){
+        return cseg_hold_or_mux_packet(s, pkt);
+    }
+    
+    start = ivr_latency_now();
+    ret = cseg_hold_or_mux_packet(s, pkt);
+    ivr_latency_record(IVR_LATENCY_CSEG, ivr_latency_now() - start);
+    return ret;
+}
+
 static int cseg_write_trailer(struct AVFormatContext *s)
 {
      
     CachedSegmentContext *cseg = s->priv_data;
-    AVFormatContext *oc = cseg->avf;
+    AVFormatContext *oc;
+    int64_t shutdown_end = 0;
+    
+    //mux the packets still held for the start dts
+    cseg_hold_or_mux_packet(s, NULL);
+    oc = cseg->avf;
  
-    av_write_trailer(oc);
+    if (oc) //NULL if rebuilding the inner muxer failed
+        av_write_trailer(oc);
 
-    if (oc->pb) {
+    if (oc && oc->pb) {
         double seg_start_ts;
         int64_t cur_segment_size = 0;
         int is_cached_list_full = 0;
@@ -894,14 +1805,12 @@ static int cseg_write_trailer(struct AVFormatContext *s)
         avio_flush(oc->pb);
         av_freep(&(oc->pb));
         
-        pthread_mutex_lock(&cseg->mutex);
-        if((cseg->flags & CSEG_FLAG_NONBLOCK) && (cseg->cached_list.seg_num >= cseg->max_nb_segments)){
+        if((cseg->flags & CSEG_FLAG_NONBLOCK) && 
+           (cached_segment_num(cseg) >= cseg->max_nb_segments)){
             if(cseg->cur_segment != NULL){
-                cached_segment_reset(cseg->cur_segment);
-                put_segment_list(&(cseg->free_list), cseg->cur_segment);
+                recycle_free_segment(cseg, cseg->cur_segment);
                 cseg->cur_segment = NULL;                
             }
-            pthread_mutex_unlock(&cseg->mutex); 
             
 //Jam(2018-01-12): remove this logic, keep the first and unfinished segment
 /*            
@@ -911,22 +1820,26 @@ static int cseg_write_trailer(struct AVFormatContext *s)
             // don't write this single unfinished segment to avoid record fragmentation
 
             if(cseg->cur_segment != NULL){
-                cached_segment_reset(cseg->cur_segment);
-                put_segment_list(&(cseg->free_list), cseg->cur_segment);
+                recycle_free_segment(cseg, cseg->cur_segment);
                 cseg->cur_segment = NULL;                
             }
-            pthread_mutex_unlock(&cseg->mutex);   
             av_log(s, AV_LOG_ERROR,
                     "drop the current single unfinished segment\n");           
 */ 
 
         }else{
-            
-            pthread_mutex_unlock(&cseg->mutex);  
             append_cur_segment(s); // lose the control of cseg->cur_segment            
         }
-    }//if (oc->pb) {
+    }//if (oc && oc->pb) {
           
+    if(cseg->shutdown_timeout > 0){
+        int64_t timeout = (int64_t)(cseg->shutdown_timeout * 1000000);
+        shutdown_end = av_gettime_relative() + timeout;
+        //a tenth of the time is left for the writer to finish on uninit
+        __atomic_store_n(&cseg->shutdown_deadline, shutdown_end - timeout / 10, 
+                         __ATOMIC_RELEASE);
+    }
+    
     if(cseg->consumer_thread_id != 0){
         void * res;
         int ret;
@@ -941,8 +1854,13 @@ static int cseg_write_trailer(struct AVFormatContext *s)
         }
         cseg->consumer_thread_id = 0;
         
+        //in case the consumer exits on error
+        spill_segments(cseg);
     }
     
+    if(shutdown_end){
+        __atomic_store_n(&cseg->shutdown_deadline, shutdown_end, __ATOMIC_RELEASE);
+    }
     if(cseg->writer){
         if(cseg->writer->uninit){
             cseg->writer->uninit(cseg);
@@ -953,8 +1871,15 @@ static int cseg_write_trailer(struct AVFormatContext *s)
     avformat_free_context(oc);
     cseg->avf = NULL;
 
-    free_segment_list(&(cseg->cached_list));
+    free_segment_ring(&(cseg->cached_ring));
+    free_segment_ring(&(cseg->free_ring));
     free_segment_list(&(cseg->free_list));
+    free_segment_list(&(cseg->backfill_list));
+    free_pending_packets(cseg);
+    if(cseg->spool_segment != NULL){
+        cached_segment_free(cseg->spool_segment);
+        cseg->spool_segment = NULL;
+    }
 
     av_freep(&cseg->filename);
  
@@ -984,13 +1909,41 @@ static const AVOption options[] = {
     {"cseg_list_size", "set maximum number of the cache list",  OFFSET(max_nb_segments),    AV_OPT_TYPE_INT,    {.i64 = 3},     1, INT_MAX, E},
     {"cseg_ts_options","set hls mpegts list of options for the container format used for hls", OFFSET(format_options_str), AV_OPT_TYPE_STRING, {.str = NULL},  0, 0,    E},
     {"cseg_seg_size",  "set maximum segment size in bytes",        OFFSET(max_seg_size),AV_OPT_TYPE_INT,  {.i64 = 10485760},     0, INT_MAX, E},
+    {"cseg_shutdown_timeout", "set max time in seconds to write the cached segments at shutdown, 0 for no limit", OFFSET(shutdown_timeout), AV_OPT_TYPE_DOUBLE, {.dbl = 0}, 0, DBL_MAX, E},
+    {"cseg_spool_dir", "set directory to save the segments left at shutdown, which are written by the next run", OFFSET(spool_dir), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, E},
+    {"cseg_ramp_up", "set durations in seconds of the first segments separated by ',', e.g. 2,4", OFFSET(ramp_up_str), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, E},
+    {"cseg_primary_video", "set the index of the video stream to split on, -1 for the first video stream", OFFSET(primary_video), AV_OPT_TYPE_INT, {.i64 = -1}, -1, INT_MAX, E},
+    {"cseg_target_size", "set segment size in bytes to split at the next key frame, 0 to split by time only", OFFSET(target_size), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, E},
+    {"cseg_min_time", "set min segment time in seconds when split by size", OFFSET(min_time), AV_OPT_TYPE_DOUBLE, {.dbl = 0}, 0, DBL_MAX, E},
+    {"cseg_max_time", "set max segment time in seconds when split by size, 0 for cseg_time", OFFSET(max_time), AV_OPT_TYPE_DOUBLE, {.dbl = 0}, 0, DBL_MAX, E},
     {"start_ts",      "set start timestamp (in seconds) for the first segment", OFFSET(start_ts),    AV_OPT_TYPE_DOUBLE,  {.dbl = -1.0},     -1.0, DBL_MAX, E},
     {"cseg_cache_time", "set min cache time in seconds for writer pause", OFFSET(pre_recoding_time),    AV_OPT_TYPE_DOUBLE,  {.dbl = 0},     0, DBL_MAX, E},
     {"use_localtime",          "set filename expansion with strftime at segment creation", OFFSET(use_localtime), AV_OPT_TYPE_INT, {.i64 = 0 }, 0, 1, E },
     {"writer_timeout",     "set timeout (in milliseconds) of writer I/O operations", OFFSET(writer_timeout),     AV_OPT_TYPE_INT, { .i64 = 30000 },         -1, INT_MAX, .flags = E },
+    {"writer_resume_interval", "set interval (in milliseconds) to retry a paused writer, 0 to wait for the next segment", OFFSET(writer_resume_interval), AV_OPT_TYPE_INT, {.i64 = 1000 }, 0, INT_MAX, E},
+    {"cseg_post_roll", "set time in seconds to go on writing after the event stops", OFFSET(post_roll_time), AV_OPT_TYPE_DOUBLE, {.dbl = 0}, 0, DBL_MAX, E},
+    {"cseg_degrade_threshold", "set number of cached segments to start recording key frames only, 0 to disable", OFFSET(degrade_threshold), AV_OPT_TYPE_INT, {.i64 = 0 }, 0, INT_MAX, E},
+    {"cseg_degrade_resume", "set number of cached segments to resume full-rate recording", OFFSET(degrade_resume), AV_OPT_TYPE_INT, {.i64 = 0 }, 0, INT_MAX, E},
+    {"writer_create_ahead", "overlap the create of the next file with the upload in ivr writer", OFFSET(writer_create_ahead), AV_OPT_TYPE_INT, {.i64 = 0 }, 0, 1, E},
+    {"writer_retries", "set max attempts of a writer request", OFFSET(writer_retries), AV_OPT_TYPE_INT, {.i64 = 2 }, 1, INT_MAX, E},
+    {"writer_retry_base", "set base delay (in milliseconds) of writer retry backoff", OFFSET(writer_retry_base), AV_OPT_TYPE_INT, {.i64 = 50 }, 0, INT_MAX, E},
+    {"writer_retry_max_delay", "set max delay (in milliseconds) of writer retry backoff", OFFSET(writer_retry_max_delay), AV_OPT_TYPE_INT, {.i64 = 2000 }, 0, INT_MAX, E},
+    {"writer_retry_budget", "set retries allowed in percentage of writer requests", OFFSET(writer_retry_budget), AV_OPT_TYPE_INT, {.i64 = 20 }, 0, 100, E},
+    {"writer_breaker_threshold", "set consecutive failures to open the circuit of a writer endpoint, 0 to disable", OFFSET(writer_breaker_threshold), AV_OPT_TYPE_INT, {.i64 = 5 }, 0, INT_MAX, E},
+    {"writer_breaker_cooldown", "set time (in milliseconds) before probing an open circuit of writer endpoint", OFFSET(writer_breaker_cooldown), AV_OPT_TYPE_INT, {.i64 = 10000 }, 0, INT_MAX, E},
+    {"writer_http_trace", "set HTTP request trace level of writer", OFFSET(http_trace), AV_OPT_TYPE_INT, {.i64 = CSEG_HTTP_TRACE_ERRORS }, CSEG_HTTP_TRACE_OFF, CSEG_HTTP_TRACE_FULL, E, "http_trace"},
+    {"off",        "no trace", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_HTTP_TRACE_OFF }, 0, 0, E, "http_trace"},
+    {"errors",     "trace the failed requests", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_HTTP_TRACE_ERRORS }, 0, 0, E, "http_trace"},
+    {"sampled",    "trace the failed requests and 1 in writer_http_trace_sample requests", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_HTTP_TRACE_SAMPLED }, 0, 0, E, "http_trace"},
+    {"full",       "trace all requests with libcurl debug output", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_HTTP_TRACE_FULL }, 0, 0, E, "http_trace"},
+    {"writer_http_trace_sample", "set N to trace 1 in N HTTP requests in sampled mode", OFFSET(http_trace_sample), AV_OPT_TYPE_INT, {.i64 = 100 }, 1, INT_MAX, E},
     {"cseg_flags",     "set flags affecting cached segement working policy", OFFSET(flags), AV_OPT_TYPE_FLAGS, {.i64 = 0 }, 0, UINT_MAX, E, "flags"},
     {"nonblock",   "never blocking in the write_packet() when the cached list is full, instead, dicard the eariest segment", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_FLAG_NONBLOCK }, 0, UINT_MAX,   E, "flags"},
     {"force_av",   "an error would occur if the output context has no video/audio stream", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_FLAG_FORCE_AV }, 0, UINT_MAX,   E, "flags"},
+    {"align_time", "split at the first key frame after each wall-clock multiple of cseg_time, e.g. :00/:10/:20", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_FLAG_ALIGN_TIME }, 0, UINT_MAX,   E, "flags"},
+    {"event_trigger", "only write the segments around the events triggered by ffmpeg_ivr_cseg_trigger(), cseg_cache_time is the pre-roll", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_FLAG_EVENT_TRIGGER }, 0, UINT_MAX,   E, "flags"},
+    {"fresh_first", "write the latest segment first after the writer falls behind, then backfill the older ones", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_FLAG_FRESH_FIRST }, 0, UINT_MAX,   E, "flags"},
+    {"degrade_audio", "keep audio in the segments recorded with key frames only", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_FLAG_DEGRADE_AUDIO }, 0, UINT_MAX,   E, "flags"},
 
     { NULL },
 };
@@ -34,6 +34,8 @@ extern "C" {
 #include "libavutil/log.h"
 #include "libavformat/avformat.h"
 
+#include "libffmpeg_ivr.h"
+
 struct CachedSegmentContext;
 typedef struct CachedSegmentContext CachedSegmentContext;
 
@@ -47,6 +49,12 @@ typedef struct CachedSegment {
     int64_t pos;
     int buffer_max_size;   
     int64_t sequence;
+    int64_t open_time;      /* monotonic time in us when the segment is opened, for latency stats */
+    int64_t append_time;    /* monotonic time in us when the segment is appended to cached list */
+    int64_t dequeue_time;   /* monotonic time in us when the consumer starts to write it */
+    int degraded;           /* only key frames are recorded because of slow writer */
+    int persist;            /* opened in the event window, should be written in event_trigger mode */
+    int spooled;            /* loaded from the spool of a previous run */
     struct CachedSegment *next;
     uint8_t buffer[0];
 } CachedSegment;
@@ -62,7 +70,29 @@ void put_segment_list(CachedSegmentList *seg_list, CachedSegment * segment);
 CachedSegment * get_segment_list(CachedSegmentList *seg_list);
 void free_segment_list(CachedSegmentList *seg_list);
 
+/* 
+ * bounded single-producer/single-consumer ring of segments, 
+ * put by one thread and got by another one without lock
+ */
+typedef struct CachedSegmentRing {
+    struct CachedSegment **slots;
+    uint32_t mask;      // number of slots - 1
+    uint32_t head;      // next slot to get, written by consumer only
+    uint32_t tail;      // next slot to put, written by producer only
+} CachedSegmentRing;
+
+int init_segment_ring(CachedSegmentRing *ring, uint32_t min_size);
+int put_segment_ring(CachedSegmentRing *ring, CachedSegment * segment);
+CachedSegment * peek_segment_ring(CachedSegmentRing *ring);
+CachedSegment * get_segment_ring(CachedSegmentRing *ring);
+uint32_t segment_ring_num(CachedSegmentRing *ring);
+void free_segment_ring(CachedSegmentRing *ring);
+
+
 
+/* the pause codes returned by write_segment() */
+#define CSEG_WRITER_PAUSE    1  // persistence is disabled for the moment, only the pre-roll is kept
+#define CSEG_WRITER_BACKOFF  2  // the storage is unavailable, all the segments are kept to retry
 
 typedef struct CachedSegmentWriter {
     
@@ -89,17 +119,35 @@ typedef struct CachedSegmentWriter {
     int (*init)(CachedSegmentContext *cseg);
     
     //return 0 on success, 
-    //       1 on writer pause for the moment
+    //       CSEG_WRITER_PAUSE or CSEG_WRITER_BACKOFF on writer pause for the moment, 
+    //         the writer may set cseg->writer_resume_hint to tell when to retry
     //       otherwise, return a negative number for error
     int (*write_segment)(CachedSegmentContext *cseg, CachedSegment *segment);
     
+    //optional, look up the start dts for dts correction, 
+    //called by the consumer thread before the first segment is written.
+    //return 0 on success, *next_dts is left AV_NOPTS_VALUE if no correction, 
+    //       a negative AVERROR on failure
+    int (*get_next_dts)(CachedSegmentContext *cseg, int64_t *next_dts);
+    
     void (*uninit)(CachedSegmentContext *cseg);
 } CachedSegmentWriter;
     
 
+typedef enum CachedSegmentHttpTrace {
+    CSEG_HTTP_TRACE_OFF = 0,
+    CSEG_HTTP_TRACE_ERRORS,     // trace the failed requests only
+    CSEG_HTTP_TRACE_SAMPLED,    // trace the failed requests and 1 in http_trace_sample requests
+    CSEG_HTTP_TRACE_FULL,       // trace all requests, including the libcurl debug output
+} CachedSegmentHttpTrace;
+
 typedef enum CachedSegmentFlags {
     CSEG_FLAG_NONBLOCK = (1 << 0),
-    CSEG_FLAG_FORCE_AV = (1 << 1)
+    CSEG_FLAG_FORCE_AV = (1 << 1),
+    CSEG_FLAG_DEGRADE_AUDIO = (1 << 2),    // keep audio in the degraded segments
+    CSEG_FLAG_FRESH_FIRST = (1 << 3),      // write the latest segment first, backfill the older ones later
+    CSEG_FLAG_EVENT_TRIGGER = (1 << 4),    // only write the segments around the events, see ffmpeg_ivr_cseg_trigger()
+    CSEG_FLAG_ALIGN_TIME = (1 << 5),       // split at the wall-clock multiples of cseg_time
 } CachedSegmentFlags;
 
 
@@ -130,9 +178,26 @@ struct CachedSegmentContext {
 
     int use_localtime;      ///< flag to expand filename with localtime
     int64_t recording_time;  // segment length in 1/AV_TIME_BASE sec
+    
+    // split by size, a segment ends at the first key frame after target_size bytes 
+    int target_size;        // in bytes, 0 for split by time only, set by a private option
+    double min_time;        // min segment time in seconds when split by size, set by a private option
+    double max_time;        // max segment time in seconds when split by size, 0 for time, set by a private option
+    int split_size;         // target_size limited by max_seg_size
+    int64_t min_recording_time;    // in 1/AV_TIME_BASE sec
+    int64_t max_recording_time;    // in 1/AV_TIME_BASE sec
+    
+    // ramp-up schedule, the shorter first segments for fast time-to-first-segment
+    char *ramp_up_str;      // durations in seconds separated by ',', set by a private option
+#define CSEG_MAX_RAMP_UP 8
+    int nb_ramp_up;
+    int64_t ramp_up_end[CSEG_MAX_RAMP_UP];  // end time of the first segments from the start, in 1/AV_TIME_BASE sec
     int has_video;
+    int primary_video;    // index of the video stream to drive the split, -1 for the first one, set by a private option
+    int video_index;      // the primary video stream actually used, -1 for none
     int has_subtitle;
     int has_audio;
+    int mux_reinit;       // codec parameters changed, rebuild avf at the next split
     int64_t start_dts;    // start pts for the whole list
 
     int64_t start_pos;    // current segment starting position
@@ -146,28 +211,96 @@ struct CachedSegmentContext {
 //#define CONSUMER_ERR_STR_LEN 1024
     //char consumer_err_str[CONSUMER_ERR_STR_LEN];
     
-    pthread_mutex_t mutex;
+    pthread_mutex_t mutex;      // only for the idle consumer to sleep on not_empty
     pthread_cond_t not_empty;
-    CachedSegmentList cached_list;
-    CachedSegmentList free_list;
+    int consumer_idle;          // consumer is (going to) sleep, the producer should signal not_empty
+    CachedSegmentRing cached_ring;  // segments to write, from mux thread to consumer
+    CachedSegmentRing free_ring;    // written segments, from consumer back to mux thread
+    CachedSegmentList free_list;    // free segments, private to mux thread
+    CachedSegmentList backfill_list;    // older segments to write after the live edge, private to consumer
+    uint32_t backfill_num;              // segments in backfill_list, for mux thread to read
     
     CachedSegmentWriter *writer;
     void * writer_priv;
     int32_t writer_timeout;
+    int writer_resume_interval; // in milliseconds, retry interval of a paused writer, set by a private option
+    int writer_resume_hint;     // in milliseconds, set by writer on pause to override writer_resume_interval,
+                                // 0 for no hint
+    int http_trace;             // enum CachedSegmentHttpTrace, set by a private option
+    int http_trace_sample;      // sample 1 in N requests, set by a private option
+    int writer_create_ahead;    // overlap the create of the next file with the upload, set by a private option
+    
+    // retry and circuit breaker policy of writer requests, set by private options
+    int writer_retries;             // max attempts of a request
+    int writer_retry_base;          // backoff base delay in milliseconds
+    int writer_retry_max_delay;     // backoff max delay in milliseconds
+    int writer_retry_budget;        // retries allowed in percentage of the requests
+    int writer_breaker_threshold;   // consecutive failures to open the circuit
+    int writer_breaker_cooldown;    // milliseconds before probing an open circuit
+    
+    // degraded recording, only key frames are recorded when the writer falls behind
+    int degrade_threshold;      // cached segments to start degraded recording, 0 to disable, set by a private option
+    int degrade_resume;         // cached segments to resume full-rate recording, set by a private option
+    int degraded;               // current recording mode
+    
+    // event-triggered recording, segments are kept in cache for pre-roll until an event is triggered
+    double post_roll_time;      // seconds to go on writing after the event stops, set by a private option
+    int event_active;           // set by ffmpeg_ivr_cseg_trigger() from any thread
+    int64_t event_stop_time;    // av_gettime_relative() when the event stops, 0 for none
+    int event_started;          // the event seen by mux thread
+    int64_t persist_sequence;   // segments up to this sequence should be written, set by mux thread
+    
+    // bounded shutdown, the segments left at the deadline are spilled to the spool
+    double shutdown_timeout;    // in seconds, 0 for no deadline, set by a private option
+    char *spool_dir;            // set by a private option
+    uint64_t spool_tag;         // tag of the spool files of this output
+    int64_t shutdown_deadline;  // av_gettime_relative() to stop the writer requests, 0 for none
+    struct CachedSegment *spool_segment;    // segment loaded from the spool, private to consumer
+#define CSEG_SPOOL_PATH_SIZE 1024
+    char spool_path[CSEG_SPOOL_PATH_SIZE];  // file of spool_segment
+    int spool_empty;            // no more spooled segments of the previous run
     
     int64_t *last_mux_dts;    // last mux dts
     
     int64_t correct_start_dts; // for dts correction
     int64_t correct_delta;
     
+    // the start dts for correction is looked up by the consumer in background,
+    // the mux thread holds the packets until it's ready
+    int64_t next_dts_seed;      // set by the consumer before next_dts_ready
+    int next_dts_ready;         // accessed atomically
+    int holding_pkts;           // the mux thread is waiting for next_dts_ready
+#define CSEG_MAX_PENDING_PKTS 4096
+    AVPacketList *pending_pkts; // packets held by the mux thread
+    AVPacketList *pending_end;
+    int nb_pending_pkts;
+    double hold_ts;             // wall-clock time when the first packet with dts is held, in seconds
+    int64_t hold_dts;           // dts of that packet, in AV_TIME_BASE
+    
     int64_t fallocate_size;  // the size for fallocate buf file
     
+    CachedSegmentStats stats;   // counters, updated atomically by a single thread each
 };
 
 extern AVOutputFormat ff_cached_segment_muxer;
 
 void register_segment_writer(CachedSegmentWriter * writer);
 
+/* count a HTTP response of the writer, status_code <= 0 means no response */
+void cseg_stats_count_http(CachedSegmentContext *cseg, int status_code);
+
+/* 
+ * limit the timeout in milliseconds (<= 0 for none) of a writer request 
+ * within the shutdown deadline, AVERROR(ETIMEDOUT) if it's expired
+ */
+int32_t cseg_writer_timeout(CachedSegmentContext *cseg, int32_t timeout);
+
+/* 
+ * the segment following the given one in the cached ring if it is to be 
+ * written next, NULL if unknown yet, only called in write_segment()
+ */
+CachedSegment * cseg_next_cached_segment(CachedSegmentContext *cseg, CachedSegment *segment);
+
 void register_cseg(void);
 
 #ifdef __cplusplus
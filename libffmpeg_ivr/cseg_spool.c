@@ -0,0 +1,213 @@
+/**
+ * This file is part of ffmpeg_ivr
+ * 
+ * Copyright (C) 2016  OpenSight (www.opensight.cn)
+ * 
+ * ffmpeg_ivr is an extension of ffmpeg to implements the new feature for IVR
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**/
+
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "libavutil/error.h"
+#include "libavutil/log.h"
+
+#include "cseg_spool.h"
+
+#define SPOOL_MAGIC     0x47455343      // "CSEG"
+#define SPOOL_VERSION   1
+#define SPOOL_EXT       ".cseg"
+#define SPOOL_BAD_EXT   ".bad"
+
+/* the header of a spool file, followed by the segment data */
+typedef struct SpoolHeader {
+    uint32_t magic;
+    uint32_t version;
+    int32_t size;
+    int32_t degraded;
+    double start_ts;
+    double duration;
+    int64_t start_dts;
+    int64_t next_dts;
+    int64_t pos;
+    int64_t sequence;
+} SpoolHeader;
+
+/* FNV-1a hash of the url */
+uint64_t cseg_spool_tag(const char *url)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const unsigned char *p;
+    
+    for(p = (const unsigned char *)url; *p; p++){
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+int cseg_spool_save(const char *dir, uint64_t tag, const CachedSegment *segment)
+{
+    char path[CSEG_SPOOL_PATH_SIZE];
+    char tmp_path[CSEG_SPOOL_PATH_SIZE];
+    SpoolHeader header;
+    FILE *fp;
+    int ret = 0;
+    
+    //named by the tag and the start time, so that the oldest one is loaded first
+    snprintf(path, sizeof(path), "%s/%016"PRIx64"-%015"PRId64"-%"PRId64 SPOOL_EXT, 
+             dir, tag, (int64_t)(segment->start_ts * 1000), segment->sequence);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    
+    memset(&header, 0, sizeof(header));
+    header.magic = SPOOL_MAGIC;
+    header.version = SPOOL_VERSION;
+    header.size = segment->size;
+    header.degraded = segment->degraded;
+    header.start_ts = segment->start_ts;
+    header.duration = segment->duration;
+    header.start_dts = segment->start_dts;
+    header.next_dts = segment->next_dts;
+    header.pos = segment->pos;
+    header.sequence = segment->sequence;
+    
+    fp = fopen(tmp_path, "wb");
+    if(fp == NULL){
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "[cseg_spool] cannot create %s:%s\n", 
+               tmp_path, av_err2str(ret));
+        return ret;
+    }
+    if(fwrite(&header, sizeof(header), 1, fp) != 1 ||
+       (segment->size > 0 && fwrite(segment->buffer, segment->size, 1, fp) != 1)){
+        ret = AVERROR(errno ? errno : EIO);
+    }else if(fflush(fp) != 0 || fsync(fileno(fp)) != 0){
+        //the data must be on disk before the file is renamed to be loaded
+        ret = AVERROR(errno);
+    }
+    if(fclose(fp) != 0 && ret == 0){
+        ret = AVERROR(errno);
+    }
+    if(ret == 0 && rename(tmp_path, path) != 0){
+        ret = AVERROR(errno);
+    }
+    if(ret < 0){
+        av_log(NULL, AV_LOG_ERROR, "[cseg_spool] cannot save %s:%s\n", 
+               path, av_err2str(ret));
+        unlink(tmp_path);
+    }
+    return ret;
+}
+
+/* find the spool file with tag and the least name (the oldest) in dir */
+static int find_oldest(const char *dir, uint64_t tag, char *name, int name_size)
+{
+    DIR *d;
+    struct dirent *entry;
+    size_t ext_len = strlen(SPOOL_EXT);
+    char prefix[32];
+    size_t prefix_len;
+    
+    snprintf(prefix, sizeof(prefix), "%016"PRIx64"-", tag);
+    prefix_len = strlen(prefix);
+    name[0] = 0;
+    d = opendir(dir);
+    if(d == NULL){
+        return errno == ENOENT ? 0 : AVERROR(errno);
+    }
+    while((entry = readdir(d)) != NULL){
+        size_t len = strlen(entry->d_name);
+        if(len <= prefix_len + ext_len || len >= name_size ||
+           strncmp(entry->d_name, prefix, prefix_len) != 0 ||
+           strcmp(entry->d_name + len - ext_len, SPOOL_EXT) != 0){
+            continue;
+        }
+        if(name[0] == 0 || strcmp(entry->d_name, name) < 0){
+            strcpy(name, entry->d_name);
+        }
+    }
+    closedir(d);
+    return name[0] != 0;
+}
+
+/* set aside a broken spool file, so that it's not loaded again */
+static void set_aside(const char *path)
+{
+    char bad_path[CSEG_SPOOL_PATH_SIZE + sizeof(SPOOL_BAD_EXT)];
+    
+    snprintf(bad_path, sizeof(bad_path), "%s" SPOOL_BAD_EXT, path);
+    if(rename(path, bad_path) != 0){
+        unlink(path);
+    }
+}
+
+int cseg_spool_load(const char *dir, uint64_t tag, CachedSegment *segment, 
+                    char *path, int path_size)
+{
+    char name[256];
+    SpoolHeader header;
+    FILE *fp;
+    int ret;
+    
+    for(;;){
+        if((ret = find_oldest(dir, tag, name, sizeof(name))) <= 0){
+            return ret;
+        }
+        snprintf(path, path_size, "%s/%s", dir, name);
+        
+        fp = fopen(path, "rb");
+        if(fp == NULL){
+            return AVERROR(errno);
+        }
+        if(fread(&header, sizeof(header), 1, fp) != 1 ||
+           header.magic != SPOOL_MAGIC || header.version != SPOOL_VERSION ||
+           header.size < 0 || header.size > segment->buffer_max_size ||
+           (header.size > 0 && fread(segment->buffer, header.size, 1, fp) != 1)){
+            fclose(fp);
+            av_log(NULL, AV_LOG_WARNING, 
+                   "[cseg_spool] %s is broken or too large, set aside\n", path);
+            set_aside(path);
+            continue;
+        }
+        fclose(fp);
+        break;
+    }
+    
+    segment->size = header.size;
+    segment->degraded = header.degraded;
+    segment->start_ts = header.start_ts;
+    segment->duration = header.duration;
+    segment->start_dts = header.start_dts;
+    segment->next_dts = header.next_dts;
+    segment->pos = header.pos;
+    segment->sequence = header.sequence;
+    segment->persist = 1;
+    segment->spooled = 1;
+    return 1;
+}
+
+void cseg_spool_remove(const char *path)
+{
+    if(unlink(path) != 0 && errno != ENOENT){
+        av_log(NULL, AV_LOG_WARNING, "[cseg_spool] cannot remove %s\n", path);
+    }
+}
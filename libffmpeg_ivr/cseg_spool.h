@@ -0,0 +1,68 @@
+/**
+ * This file is part of ffmpeg_ivr
+ * 
+ * Copyright (C) 2016  OpenSight (www.opensight.cn)
+ * 
+ * ffmpeg_ivr is an extension of ffmpeg to implements the new feature for IVR
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**/
+
+
+#ifndef CSEG_SPOOL_H
+#define CSEG_SPOOL_H
+
+#include "cached_segment.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A local spool of segments.
+ *
+ * The segments which cannot be written before the shutdown deadline
+ * are saved as files in the spool directory, one file per segment
+ * with its metadata, and uploaded by the next run. A file is written
+ * to a temporary name, synced and renamed, so a partial file is never 
+ * loaded. The files are tagged by the output url, so that a directory 
+ * can be shared by several outputs.
+ */
+
+/* the tag of the spool files for the output url */
+uint64_t cseg_spool_tag(const char *url);
+
+/*
+ * save the segment to a file with tag in the spool directory dir,
+ * return 0 on success, a negative AVERROR on failure
+ */
+int cseg_spool_save(const char *dir, uint64_t tag, const CachedSegment *segment);
+
+/*
+ * load the oldest spooled segment with tag in dir to segment, whose buffer 
+ * must be large enough, and return the path of its file in path, 
+ * which should be removed by cseg_spool_remove() after written.
+ * return 1 if a segment is loaded, 0 if the spool is empty, 
+ * a negative AVERROR on failure
+ */
+int cseg_spool_load(const char *dir, uint64_t tag, CachedSegment *segment, 
+                    char *path, int path_size);
+
+void cseg_spool_remove(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,370 @@
+/**
+ * This file is part of ffmpeg_ivr
+ * 
+ * Copyright (C) 2016  OpenSight (www.opensight.cn)
+ * 
+ * ffmpeg_ivr is an extension of ffmpeg to implements the new feature for IVR
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libavutil/error.h"
+
+#include "ivr_json.h"
+
+#define MAX_DEPTH  32
+
+typedef struct JsonScanner {
+    const char *p;
+    const char *end;
+} JsonScanner;
+
+static void skip_space(JsonScanner *s)
+{
+    while(s->p < s->end && 
+          (*s->p == ' ' || *s->p == '\t' || *s->p == '\n' || *s->p == '\r')){
+        s->p++;
+    }
+}
+
+/* scan a string, s->p is at the opening quote. 
+   return 0 and the raw content slice on success */
+static int scan_string(JsonScanner *s, const char **str, int *len)
+{
+    const char *start = ++s->p;
+    while(s->p < s->end){
+        char c = *s->p;
+        if(c == '"'){
+            *str = start;
+            *len = s->p - start;
+            s->p++;
+            return 0;
+        }else if(c == '\\'){
+            s->p += 2;
+        }else if((unsigned char)c < 0x20){
+            return AVERROR_INVALIDDATA;
+        }else{
+            s->p++;
+        }
+    }
+    return AVERROR_INVALIDDATA;
+}
+
+static int scan_number(JsonScanner *s, double *number)
+{
+    char buf[64];
+    const char *start = s->p;
+    char *endp;
+    int len;
+    
+    while(s->p < s->end && 
+          ((*s->p >= '0' && *s->p <= '9') || *s->p == '-' || *s->p == '+' || 
+           *s->p == '.' || *s->p == 'e' || *s->p == 'E')){
+        s->p++;
+    }
+    len = s->p - start;
+    if(len == 0 || len >= sizeof(buf)){
+        return AVERROR_INVALIDDATA;
+    }
+    //the buffer may be not NUL-terminated, copy to stack for strtod
+    memcpy(buf, start, len);
+    buf[len] = 0;
+    *number = strtod(buf, &endp);
+    if(endp != buf + len){
+        return AVERROR_INVALIDDATA;
+    }
+    return 0;
+}
+
+static int scan_literal(JsonScanner *s, const char *literal)
+{
+    int len = strlen(literal);
+    if(s->end - s->p < len || memcmp(s->p, literal, len) != 0){
+        return AVERROR_INVALIDDATA;
+    }
+    s->p += len;
+    return 0;
+}
+
+/* skip any value, used for the members not requested and nested containers */
+static int skip_value(JsonScanner *s, int depth)
+{
+    const char *str;
+    double number;
+    int len, ret;
+    char close;
+    
+    if(depth > MAX_DEPTH){
+        return AVERROR_INVALIDDATA;
+    }
+    skip_space(s);
+    if(s->p >= s->end){
+        return AVERROR_INVALIDDATA;
+    }
+    switch(*s->p){
+    case '"':
+        return scan_string(s, &str, &len);
+    case 't':
+        return scan_literal(s, "true");
+    case 'f':
+        return scan_literal(s, "false");
+    case 'n':
+        return scan_literal(s, "null");
+    case '{':
+    case '[':
+        close = (*s->p == '{') ? '}' : ']';
+        s->p++;
+        skip_space(s);
+        if(s->p < s->end && *s->p == close){
+            s->p++;
+            return 0;
+        }
+        for(;;){
+            if(close == '}'){
+                skip_space(s);
+                if(s->p >= s->end || *s->p != '"'){
+                    return AVERROR_INVALIDDATA;
+                }
+                if((ret = scan_string(s, &str, &len)) < 0){
+                    return ret;
+                }
+                skip_space(s);
+                if(s->p >= s->end || *s->p != ':'){
+                    return AVERROR_INVALIDDATA;
+                }
+                s->p++;
+            }
+            if((ret = skip_value(s, depth + 1)) < 0){
+                return ret;
+            }
+            skip_space(s);
+            if(s->p >= s->end){
+                return AVERROR_INVALIDDATA;
+            }
+            if(*s->p == ','){
+                s->p++;
+            }else if(*s->p == close){
+                s->p++;
+                return 0;
+            }else{
+                return AVERROR_INVALIDDATA;
+            }
+        }
+    default:
+        return scan_number(s, &number);
+    }
+}
+
+static int key_match(const char *key, const char *str, int len)
+{
+    int i;
+    for(i = 0; i < len; i++){
+        char a = key[i], b = str[i];
+        if(a == 0){
+            return 0;
+        }
+        if(a >= 'A' && a <= 'Z') a += 'a' - 'A';
+        if(b >= 'A' && b <= 'Z') b += 'a' - 'A';
+        if(a != b){
+            return 0;
+        }
+    }
+    return key[len] == 0;
+}
+
+int ivr_json_parse(const char *json, int json_len, 
+                   IvrJsonField *fields, int nb_fields)
+{
+    JsonScanner s;
+    int i, ret;
+    
+    for(i = 0; i < nb_fields; i++){
+        fields[i].type = IVR_JSON_NONE;
+        fields[i].str = NULL;
+        fields[i].str_len = 0;
+        fields[i].number = 0.0;
+    }
+    
+    s.p = json;
+    s.end = json + json_len;
+    skip_space(&s);
+    if(s.p >= s.end || *s.p != '{'){
+        return AVERROR_INVALIDDATA;
+    }
+    s.p++;
+    skip_space(&s);
+    if(s.p < s.end && *s.p == '}'){
+        return 0;
+    }
+    
+    for(;;){
+        const char *key;
+        int key_len;
+        IvrJsonField *field = NULL;
+        
+        skip_space(&s);
+        if(s.p >= s.end || *s.p != '"'){
+            return AVERROR_INVALIDDATA;
+        }
+        if((ret = scan_string(&s, &key, &key_len)) < 0){
+            return ret;
+        }
+        skip_space(&s);
+        if(s.p >= s.end || *s.p != ':'){
+            return AVERROR_INVALIDDATA;
+        }
+        s.p++;
+        skip_space(&s);
+        if(s.p >= s.end){
+            return AVERROR_INVALIDDATA;
+        }
+        
+        for(i = 0; i < nb_fields; i++){
+            if(fields[i].type == IVR_JSON_NONE && 
+               key_match(fields[i].key, key, key_len)){
+                field = &fields[i];
+                break;
+            }
+        }
+        
+        if(field != NULL && *s.p == '"'){
+            if((ret = scan_string(&s, &field->str, &field->str_len)) < 0){
+                return ret;
+            }
+            field->type = IVR_JSON_STRING;
+        }else if(field != NULL && (*s.p == '-' || (*s.p >= '0' && *s.p <= '9'))){
+            if((ret = scan_number(&s, &field->number)) < 0){
+                return ret;
+            }
+            field->type = IVR_JSON_NUMBER;
+        }else{
+            if((ret = skip_value(&s, 1)) < 0){
+                return ret;
+            }
+            if(field != NULL){
+                field->type = IVR_JSON_OTHER;
+            }
+        }
+        
+        skip_space(&s);
+        if(s.p >= s.end){
+            return AVERROR_INVALIDDATA;
+        }
+        if(*s.p == ','){
+            s.p++;
+        }else if(*s.p == '}'){
+            return 0;
+        }else{
+            return AVERROR_INVALIDDATA;
+        }
+    }
+}
+
+static int parse_hex4(const char *p, unsigned *code)
+{
+    int i;
+    *code = 0;
+    for(i = 0; i < 4; i++){
+        char c = p[i];
+        *code <<= 4;
+        if(c >= '0' && c <= '9')      *code |= c - '0';
+        else if(c >= 'a' && c <= 'f') *code |= c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F') *code |= c - 'A' + 10;
+        else return AVERROR_INVALIDDATA;
+    }
+    return 0;
+}
+
+int ivr_json_get_string(const IvrJsonField *field, char *dst, int dst_size)
+{
+    const char *p, *end;
+    int len = 0;
+    
+    if(field->type != IVR_JSON_STRING || dst_size <= 0){
+        return AVERROR(EINVAL);
+    }
+    p = field->str;
+    end = field->str + field->str_len;
+    
+    while(p < end && len < dst_size - 1){
+        unsigned code;
+        char utf8[4];
+        int n, i;
+        
+        if(*p != '\\'){
+            dst[len++] = *p++;
+            continue;
+        }
+        p++;
+        if(p >= end){
+            break;
+        }
+        switch(*p){
+        case 'b': dst[len++] = '\b'; p++; continue;
+        case 'f': dst[len++] = '\f'; p++; continue;
+        case 'n': dst[len++] = '\n'; p++; continue;
+        case 'r': dst[len++] = '\r'; p++; continue;
+        case 't': dst[len++] = '\t'; p++; continue;
+        case 'u': 
+            break;
+        default:  dst[len++] = *p++; continue;
+        }
+        
+        //\uXXXX, with surrogate pair
+        if(end - p < 5 || parse_hex4(p + 1, &code) < 0){
+            break;
+        }
+        p += 5;
+        if(code >= 0xD800 && code <= 0xDBFF){
+            unsigned low;
+            if(end - p < 6 || p[0] != '\\' || p[1] != 'u' || 
+               parse_hex4(p + 2, &low) < 0 || low < 0xDC00 || low > 0xDFFF){
+                break;
+            }
+            p += 6;
+            code = 0x10000 + (((code & 0x3FF) << 10) | (low & 0x3FF));
+        }
+        if(code < 0x80){
+            utf8[0] = code;
+            n = 1;
+        }else if(code < 0x800){
+            utf8[0] = 0xC0 | (code >> 6);
+            utf8[1] = 0x80 | (code & 0x3F);
+            n = 2;
+        }else if(code < 0x10000){
+            utf8[0] = 0xE0 | (code >> 12);
+            utf8[1] = 0x80 | ((code >> 6) & 0x3F);
+            utf8[2] = 0x80 | (code & 0x3F);
+            n = 3;
+        }else{
+            utf8[0] = 0xF0 | (code >> 18);
+            utf8[1] = 0x80 | ((code >> 12) & 0x3F);
+            utf8[2] = 0x80 | ((code >> 6) & 0x3F);
+            utf8[3] = 0x80 | (code & 0x3F);
+            n = 4;
+        }
+        if(len + n > dst_size - 1){
+            break;
+        }
+        for(i = 0; i < n; i++){
+            dst[len++] = utf8[i];
+        }
+    }
+    dst[len] = 0;
+    return len;
+}
@@ -0,0 +1,77 @@
+/**
+ * This file is part of ffmpeg_ivr
+ * 
+ * Copyright (C) 2016  OpenSight (www.opensight.cn)
+ * 
+ * ffmpeg_ivr is an extension of ffmpeg to implements the new feature for IVR
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**/
+
+#ifndef IVR_JSON_H
+#define IVR_JSON_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A tiny allocation-free JSON reader for the IVR REST responses.
+ *
+ * It scans one JSON object in place and only picks up the requested
+ * top-level members, the other values (including nested objects/arrays)
+ * are validated and skipped. The input buffer is never modified, string
+ * values are returned as slices of the buffer and unescaped on demand
+ * by ivr_json_get_string(). Member names are compared case-insensitively
+ * (like cJSON_GetObjectItem()) and without unescaping, and the first
+ * occurrence of a member wins.
+ */
+
+typedef enum IvrJsonType {
+    IVR_JSON_NONE = 0,      // member absent
+    IVR_JSON_STRING,
+    IVR_JSON_NUMBER,
+    IVR_JSON_OTHER,         // true/false/null/object/array
+} IvrJsonType;
+
+typedef struct IvrJsonField {
+    const char *key;        // in: the member name to pick up
+    
+    IvrJsonType type;       // out
+    const char *str;        // out: the raw (escaped) string content, not NUL-terminated
+    int str_len;            // out
+    double number;          // out
+} IvrJsonField;
+
+/*
+ * parse the JSON object of json_len bytes, filling the given fields,
+ * return 0 on success, a negative AVERROR if the text is not a valid object
+ */
+int ivr_json_parse(const char *json, int json_len, 
+                   IvrJsonField *fields, int nb_fields);
+
+/*
+ * unescape the string field to dst (always NUL-terminated),
+ * return the length of the result, or a negative AVERROR if 
+ * the field is not a string 
+ */
+int ivr_json_get_string(const IvrJsonField *field, char *dst, int dst_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
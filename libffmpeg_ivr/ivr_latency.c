@@ -0,0 +1,168 @@
+/**
+ * This file is part of ffmpeg_ivr
+ * 
+ * Copyright (C) 2016  OpenSight (www.opensight.cn)
+ * 
+ * ffmpeg_ivr is an extension of ffmpeg to implements the new feature for IVR
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**/
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "libavutil/log.h"
+
+#include "ivr_latency.h"
+
+#define SUB_COUNT   (1 << IVR_LATENCY_SUB_BITS)
+
+volatile int ivr_latency_enabled = 0;
+
+static const char * const stage_names[IVR_LATENCY_NB] = {
+    "read",
+    "dispatch",
+    "mux",
+    "cseg",
+    "append",
+    "queue",
+    "write",
+    "segment",
+};
+
+static IvrLatencySnapshot histograms;
+
+
+static int value_to_bucket(int64_t v)
+{
+    int e;
+    if(v < SUB_COUNT){
+        return v < 0 ? 0 : (int)v;
+    }
+    if(v >= (INT64_C(1) << IVR_LATENCY_MAX_BITS)){
+        v = (INT64_C(1) << IVR_LATENCY_MAX_BITS) - 1;
+    }
+    e = 63 - __builtin_clzll((uint64_t)v);  // e >= IVR_LATENCY_SUB_BITS
+    return SUB_COUNT + (e - IVR_LATENCY_SUB_BITS) * SUB_COUNT + 
+           (int)((v >> (e - IVR_LATENCY_SUB_BITS)) - SUB_COUNT);
+}
+
+/* the middle value of the bucket */
+static int64_t bucket_to_value(int idx)
+{
+    int e, m;
+    if(idx < SUB_COUNT){
+        return idx;
+    }
+    e = (idx - SUB_COUNT) / SUB_COUNT + IVR_LATENCY_SUB_BITS;
+    m = (idx - SUB_COUNT) % SUB_COUNT + SUB_COUNT;
+    return ((int64_t)m << (e - IVR_LATENCY_SUB_BITS)) + 
+           ((INT64_C(1) << (e - IVR_LATENCY_SUB_BITS)) >> 1);
+}
+
+void ivr_latency_enable(int enable)
+{
+    ivr_latency_enabled = enable;
+}
+
+void ivr_latency_record(IvrLatencyStage stage, int64_t usec)
+{
+    int64_t old_max;
+    
+    if(stage < 0 || stage >= IVR_LATENCY_NB){
+        return;
+    }
+    __sync_fetch_and_add(&histograms.counts[stage][value_to_bucket(usec)], 1);
+    
+    old_max = histograms.max[stage];
+    while(usec > old_max){
+        if(__sync_bool_compare_and_swap(&histograms.max[stage], old_max, usec)){
+            break;
+        }
+        old_max = histograms.max[stage];
+    }
+}
+
+const char *ivr_latency_stage_name(IvrLatencyStage stage)
+{
+    if(stage < 0 || stage >= IVR_LATENCY_NB){
+        return "unknown";
+    }
+    return stage_names[stage];
+}
+
+void ivr_latency_snapshot(IvrLatencySnapshot *snap)
+{
+    //counters may move on during the copy, which is fine for statistics
+    memcpy(snap, &histograms, sizeof(IvrLatencySnapshot));
+}
+
+void ivr_latency_summary(const IvrLatencySnapshot *cur, 
+                         const IvrLatencySnapshot *prev,
+                         IvrLatencyStage stage, 
+                         IvrLatencySummary *sum)
+{
+    static const double quantiles[4] = {0.5, 0.9, 0.99, 0.999};
+    int64_t *results[4];
+    uint64_t total = 0, acc = 0;
+    int i, q = 0;
+    
+    memset(sum, 0, sizeof(IvrLatencySummary));
+    if(stage < 0 || stage >= IVR_LATENCY_NB){
+        return;
+    }
+    results[0] = &sum->p50;
+    results[1] = &sum->p90;
+    results[2] = &sum->p99;
+    results[3] = &sum->p999;
+    
+    for(i = 0; i < IVR_LATENCY_BUCKETS; i++){
+        total += cur->counts[stage][i] - (prev ? prev->counts[stage][i] : 0);
+    }
+    sum->count = total;
+    sum->max = cur->max[stage];
+    if(total == 0){
+        return;
+    }
+    
+    for(i = 0; i < IVR_LATENCY_BUCKETS && q < 4; i++){
+        acc += cur->counts[stage][i] - (prev ? prev->counts[stage][i] : 0);
+        while(q < 4 && acc >= (uint64_t)(quantiles[q] * total + 0.5) && acc > 0){
+            *results[q] = bucket_to_value(i);
+            q++;
+        }
+    }
+}
+
+void ivr_latency_report(void *avcl, int level)
+{
+    static IvrLatencySnapshot last, cur;
+    IvrLatencySummary sum;
+    int stage;
+    
+    ivr_latency_snapshot(&cur);
+    for(stage = 0; stage < IVR_LATENCY_NB; stage++){
+        ivr_latency_summary(&cur, &last, stage, &sum);
+        if(sum.count == 0){
+            continue;
+        }
+        av_log(avcl, level, 
+               "[latency] %-8s n:%"PRIu64" p50:%.3fms p90:%.3fms p99:%.3fms p99.9:%.3fms max:%.3fms\n",
+               stage_names[stage], sum.count, 
+               sum.p50 / 1000.0, sum.p90 / 1000.0, sum.p99 / 1000.0, 
+               sum.p999 / 1000.0, sum.max / 1000.0);
+    }
+    memcpy(&last, &cur, sizeof(IvrLatencySnapshot));
+}
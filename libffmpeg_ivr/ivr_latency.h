@@ -0,0 +1,100 @@
+/**
+ * This file is part of ffmpeg_ivr
+ * 
+ * Copyright (C) 2016  OpenSight (www.opensight.cn)
+ * 
+ * ffmpeg_ivr is an extension of ffmpeg to implements the new feature for IVR
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**/
+
+#ifndef IVR_LATENCY_H
+#define IVR_LATENCY_H
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Per-stage latency histograms of the recording pipeline.
+ *
+ * Each stage keeps a log-linear (HDR style) histogram of microsecond
+ * latencies: values below 16us are exact, above that every power of two
+ * is split into 16 sub-buckets, which bounds the relative error to 1/16.
+ * Recording is lock-free and can be done from any thread.
+ */
+
+typedef enum IvrLatencyStage {
+    IVR_LATENCY_READ = 0,   // av_read_frame() duration
+    IVR_LATENCY_DISPATCH,   // av_read_frame() return -> write_frame() entry
+    IVR_LATENCY_MUX,        // write_frame() entry -> muxer return
+    IVR_LATENCY_CSEG,       // cseg_write_packet() duration
+    IVR_LATENCY_APPEND,     // append_cur_segment() duration, i.e. blocked on a full cache
+    IVR_LATENCY_QUEUE,      // append_cur_segment() -> consumer dequeue
+    IVR_LATENCY_WRITE,      // consumer dequeue -> write_segment() completion
+    IVR_LATENCY_SEGMENT,    // segment opened -> write_segment() completion
+    IVR_LATENCY_NB
+} IvrLatencyStage;
+
+#define IVR_LATENCY_SUB_BITS    4
+#define IVR_LATENCY_MAX_BITS    40     // values are clipped to 2^40 us (~12 days)
+#define IVR_LATENCY_BUCKETS     ((1 << IVR_LATENCY_SUB_BITS) * (IVR_LATENCY_MAX_BITS - IVR_LATENCY_SUB_BITS + 1))
+
+typedef struct IvrLatencySnapshot {
+    uint64_t counts[IVR_LATENCY_NB][IVR_LATENCY_BUCKETS];
+    int64_t max[IVR_LATENCY_NB];
+} IvrLatencySnapshot;
+
+typedef struct IvrLatencySummary {
+    uint64_t count;
+    int64_t p50, p90, p99, p999;    // in microseconds
+    int64_t max;                    // all-time max, in microseconds
+} IvrLatencySummary;
+
+extern volatile int ivr_latency_enabled;
+
+/* monotonic clock in microseconds, the time base of all the checkpoints */
+static inline int64_t ivr_latency_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void ivr_latency_enable(int enable);
+
+void ivr_latency_record(IvrLatencyStage stage, int64_t usec);
+
+const char *ivr_latency_stage_name(IvrLatencyStage stage);
+
+/* copy the current histograms to snap */
+void ivr_latency_snapshot(IvrLatencySnapshot *snap);
+
+/* summarize the samples recorded between prev (may be NULL) and cur */
+void ivr_latency_summary(const IvrLatencySnapshot *cur, 
+                         const IvrLatencySnapshot *prev,
+                         IvrLatencyStage stage, 
+                         IvrLatencySummary *sum);
+
+/* log the percentiles of every stage since the last report */
+void ivr_latency_report(void *avcl, int level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
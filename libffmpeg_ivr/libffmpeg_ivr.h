@@ -35,6 +35,48 @@ extern "C" {
 /* register all components of ffmpeg_ivr to ffmpeg library */
 void ffmpeg_ivr_register(void);
 
+struct AVFormatContext;
+
+/* runtime statistics of a cseg output */
+typedef struct CachedSegmentStats {
+    uint32_t cached_segments;   // segments waiting in the cached list
+    uint32_t free_segments;     // segments in the free list
+    uint32_t max_segments;      // capacity of the cached list
+    int64_t segments_written;
+    int64_t segments_dropped;   // dropped because of slow writer
+    int64_t segments_degraded;  // recorded with key frames only because of slow writer
+    int64_t bytes_written;
+    int64_t write_time_total;   // sum of the writer's write_segment() time, in microseconds
+    int64_t write_time_max;     // in microseconds
+    int64_t http_2xx;           // HTTP responses of the writer by status class
+    int64_t http_3xx;
+    int64_t http_4xx;
+    int64_t http_5xx;
+    int64_t http_errors;        // HTTP requests failed without response
+} CachedSegmentStats;
+
+/* 
+ * get the statistics of the cseg output context s, 
+ * return 0 on success, AVERROR(EINVAL) if s is not a cseg output 
+ */
+int ffmpeg_ivr_cseg_stats(struct AVFormatContext *s, CachedSegmentStats *stats);
+
+/* 
+ * start (active is 1) or stop (active is 0) an event for the cseg output 
+ * context s with the event_trigger flag, the cached segments (pre-roll) and 
+ * the following ones until cseg_post_roll seconds after the event stops 
+ * are written. It can be called from any thread. 
+ * return 0 on success, AVERROR(EINVAL) if s is not a cseg output 
+ */
+int ffmpeg_ivr_cseg_trigger(struct AVFormatContext *s, int active);
+
+/* 
+ * check if s is a cseg output context with the event_trigger flag, 
+ * valid after its header is written. 
+ * return 1 if so, otherwise 0
+ */
+int ffmpeg_ivr_cseg_event_enabled(struct AVFormatContext *s);
+
 
 
 #ifdef __cplusplus
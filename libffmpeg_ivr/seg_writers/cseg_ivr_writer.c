@@ -40,21 +40,21 @@
 #include "libavutil/avstring.h"
 #include "libavutil/opt.h"
 #include "libavutil/dict.h"
+#include "libavutil/time.h"
+#include "libavutil/random_seed.h"
 
 #include "libavformat/avformat.h"
     
 #include "../cached_segment.h"
-#include "../cJSON.h"
+#include "../ivr_json.h"
 
 #define MIN(a,b) ((a) > (b) ? (b) : (a))
 
-#define HTTP_DEFAULT_RETRY_NUM    2
-
-#define RAMDOM_SLEEP_MAX_MS     47
+#define RETRY_BUDGET_MAX_TOKENS 10.0
 
 #define MAX_FILE_NAME 128
 #define MAX_URI_LEN 1024
-#define MAX_POST_STR_LEN 255
+#define MAX_POST_STR_LEN 511
 
 #define  IVR_NAME_FIELD_KEY  "name"
 #define  IVR_URI_FIELD_KEY  "uri"
@@ -63,13 +63,75 @@
 
 #define MAX_HTTP_RESULT_SIZE  4096
 
-#define ENABLE_CURLOPT_VERBOSE
-
 #define HTTP_REQUEST_TIMEOUT 10000
 
 
 
+/* 
+ * Retry policy shared by all the endpoints of a writer: exponential 
+ * backoff with jitter, limited by a retry budget, i.e. a token bucket 
+ * refilled by a fraction of each request, so that a degraded service 
+ * is not hammered by the retries of every stream.
+ */
+typedef struct HttpRetryPolicy {
+    int max_attempts;
+    int base_delay;     // in milliseconds
+    int max_delay;      // in milliseconds
+    double budget_ratio;
+    double budget_tokens;
+    int breaker_threshold;
+    int breaker_cooldown;   // in milliseconds
+    unsigned int rand_seed;
+    pthread_mutex_t mutex;  // for budget_tokens and rand_seed, the endpoints can be requested concurrently
+} HttpRetryPolicy;
+
+typedef enum HttpBreakerState {
+    BREAKER_CLOSED = 0,
+    BREAKER_OPEN,
+    BREAKER_HALF_OPEN,
+} HttpBreakerState;
+
+/* a remote service with its own circuit breaker */
+typedef struct HttpEndpoint {
+    const char *name;
+    HttpRetryPolicy *policy;
+    int retry_client_errors;    // retry 4xx status as well
+    HttpBreakerState state;
+    int consecutive_failures;
+    int64_t open_until;     // av_gettime_relative() to probe the open circuit
+} HttpEndpoint;
+
+/* the metadata of a file sent to IVR */
+typedef struct IvrFileInfo {
+    int size;
+    double start;
+    double duration;
+    int64_t next_dts;
+    int degraded;
+} IvrFileInfo;
+
+struct IvrWriterPriv;
+
+/* 
+ * the create of the next file, run along with the upload of the current one, 
+ * which is finalized by this create
+ */
+typedef struct IvrCreateAhead {
+    struct IvrWriterPriv *priv;
+    CURL * easyhandle;
+    char http_response_buf[MAX_HTTP_RESULT_SIZE];
+    pthread_t thread;
+    int running;
+    int64_t sequence;       // sequence of the segment the file is created for, -1 if none
+    IvrFileInfo info;
+    char last_filename[MAX_FILE_NAME];
+    char filename[MAX_FILE_NAME];
+    char file_uri[MAX_URI_LEN];
+    int ret;
+} IvrCreateAhead;
+
 typedef struct IvrWriterPriv {
+    CachedSegmentContext *cseg;
     CURL * easyhandle;
     char ivr_rest_uri[MAX_URI_LEN];
     char last_filename[MAX_FILE_NAME];
@@ -80,15 +142,156 @@ typedef struct IvrWriterPriv {
     int64_t cached_offset;
     int64_t cached_file_reserve_size;
     int64_t fallocate_size;
+    uint32_t http_request_count;  // for trace sampling
+    
+    int64_t last_sequence;   // sequence of the segment in last_filename
+    IvrCreateAhead ahead;
+    
+    HttpRetryPolicy retry_policy;
+    HttpEndpoint metadata_ep;   // the IVR REST service
+    HttpEndpoint storage_ep;    // the storage for upload
 } IvrWriterPriv;
 
-static void random_msleep()
+static void retry_policy_init(HttpRetryPolicy *policy, CachedSegmentContext *cseg)
+{
+    policy->max_attempts = cseg->writer_retries;
+    policy->base_delay = cseg->writer_retry_base;
+    policy->max_delay = cseg->writer_retry_max_delay;
+    policy->budget_ratio = cseg->writer_retry_budget / 100.0;
+    policy->budget_tokens = RETRY_BUDGET_MAX_TOKENS;
+    policy->breaker_threshold = cseg->writer_breaker_threshold;
+    policy->breaker_cooldown = cseg->writer_breaker_cooldown;
+    policy->rand_seed = av_get_random_seed(); //desynchronize the streams
+    pthread_mutex_init(&policy->mutex, NULL);
+}
+
+static void endpoint_init(HttpEndpoint *ep, const char *name, 
+                          HttpRetryPolicy *policy, int retry_client_errors)
 {
-    struct timeval tv;
-    int ms;
-    gettimeofday(&tv, NULL);
-    ms = tv.tv_usec % RAMDOM_SLEEP_MAX_MS + 1;
-    usleep(ms * 1000);
+    ep->name = name;
+    ep->policy = policy;
+    ep->retry_client_errors = retry_client_errors;
+    ep->state = BREAKER_CLOSED;
+    ep->consecutive_failures = 0;
+    ep->open_until = 0;
+}
+
+/* check if a request to the endpoint is allowed by its circuit breaker */
+static int breaker_allow(HttpEndpoint *ep)
+{
+    if(ep->state == BREAKER_OPEN){
+        if(av_gettime_relative() < ep->open_until){
+            return 0;
+        }
+        //let one request probe the endpoint
+        ep->state = BREAKER_HALF_OPEN;
+    }
+    return 1;
+}
+
+static void breaker_report(HttpEndpoint *ep, int failed)
+{
+    HttpRetryPolicy *policy = ep->policy;
+    
+    if(!failed){
+        if(ep->state != BREAKER_CLOSED){
+            av_log(NULL, AV_LOG_INFO, "[cseg_ivr_writer] %s endpoint recovered, circuit closed\n", 
+                   ep->name);
+        }
+        ep->state = BREAKER_CLOSED;
+        ep->consecutive_failures = 0;
+        return;
+    }
+    
+    ep->consecutive_failures++;
+    if(policy->breaker_threshold > 0 &&
+       (ep->state == BREAKER_HALF_OPEN || 
+        ep->consecutive_failures >= policy->breaker_threshold)){
+        if(ep->state != BREAKER_OPEN){
+            av_log(NULL, AV_LOG_WARNING, 
+                   "[cseg_ivr_writer] %s endpoint failed %d times, circuit opened for %d ms\n", 
+                   ep->name, ep->consecutive_failures, policy->breaker_cooldown);
+        }
+        ep->state = BREAKER_OPEN;
+        ep->open_until = av_gettime_relative() + (int64_t)policy->breaker_cooldown * 1000;
+    }
+}
+
+/* 
+ * sleep for the backoff delay if the request can be retried, 
+ * return 1 to retry, 0 to give up 
+ */
+static int retry_backoff(CachedSegmentContext *cseg, HttpEndpoint *ep, int attempt)
+{
+    HttpRetryPolicy *policy = ep->policy;
+    int64_t delay;
+    int32_t remaining;
+    
+    if(attempt + 1 >= policy->max_attempts){
+        return 0;
+    }
+    
+    pthread_mutex_lock(&policy->mutex);
+    if(policy->budget_tokens < 1.0){
+        pthread_mutex_unlock(&policy->mutex);
+        return 0;
+    }
+    //equal jitter: half of the exponential delay is random
+    delay = FFMIN((int64_t)policy->base_delay << FFMIN(attempt, 20), policy->max_delay);
+    if(delay > 1){
+        delay = delay / 2 + rand_r(&policy->rand_seed) % (delay / 2 + 1);
+    }
+    //no retry after the shutdown deadline
+    remaining = cseg_writer_timeout(cseg, 0);
+    if(remaining < 0 || (remaining > 0 && delay >= remaining)){
+        pthread_mutex_unlock(&policy->mutex);
+        return 0;
+    }
+    policy->budget_tokens -= 1.0;
+    pthread_mutex_unlock(&policy->mutex);
+    if(delay > 0){
+        av_usleep(delay * 1000);
+    }
+    return 1;
+}
+
+static void retry_budget_deposit(HttpRetryPolicy *policy)
+{
+    pthread_mutex_lock(&policy->mutex);
+    policy->budget_tokens = FFMIN(policy->budget_tokens + policy->budget_ratio, 
+                                  RETRY_BUDGET_MAX_TOKENS);
+    pthread_mutex_unlock(&policy->mutex);
+}
+
+static int http_status_retriable(HttpEndpoint *ep, long status)
+{
+    return status >= 500 || status == 408 || status == 429 ||
+           (ep->retry_client_errors && status >= 400);
+}
+
+/* if any endpoint is unavailable, the writer should pause instead of failing */
+static int writer_circuit_open(IvrWriterPriv *priv)
+{
+    return priv->metadata_ep.state != BREAKER_CLOSED || 
+           priv->storage_ep.state != BREAKER_CLOSED;
+}
+
+/* milliseconds until the open circuits can be probed, 0 if none is open */
+static int writer_resume_delay(IvrWriterPriv *priv)
+{
+    int64_t now = av_gettime_relative();
+    int64_t open_until = 0;
+    
+    if(priv->metadata_ep.state == BREAKER_OPEN){
+        open_until = priv->metadata_ep.open_until;
+    }
+    if(priv->storage_ep.state == BREAKER_OPEN){
+        open_until = FFMAX(open_until, priv->storage_ep.open_until);
+    }
+    if(open_until <= now){
+        return 0;
+    }
+    return (int)((open_until - now + 999) / 1000);
 }
 
 static int http_status_to_av_code(int status_code)
@@ -136,12 +339,134 @@ static size_t http_read_callback(char *ptr, size_t size, size_t nmemb, void *use
     return data_size;
 }
 
+/* 
+ * the uri to log, only the scheme, host and path are kept, 
+ * the user info and the query may carry the credentials (e.g. a presigned storage uri)
+ */
+static const char * http_log_uri(const char * http_uri, char * buf, int buf_size)
+{
+    const char * scheme_end = strstr(http_uri, "://");
+    const char * host = (scheme_end != NULL) ? scheme_end + 3 : http_uri;
+    const char * at = memchr(host, '@', strcspn(host, "/?#"));
+    int scheme_len = host - http_uri;
+    
+    if(at != NULL){
+        host = at + 1;
+    }
+    snprintf(buf, buf_size, "%.*s%.*s", 
+             scheme_len, http_uri, (int)strcspn(host, "?#"), host);
+    return buf;
+}
+
+static int http_debug_callback(CURL *handle, curl_infotype type, 
+                               char *data, size_t size, void *userptr)
+{
+    const char *dir;
+    char line[MAX_URI_LEN];
+    size_t i = 0;
+    
+    switch(type){
+    case CURLINFO_TEXT:
+        dir = "*";
+        break;
+    case CURLINFO_HEADER_OUT:
+        dir = ">";
+        break;
+    case CURLINFO_HEADER_IN:
+        dir = "<";
+        break;
+    default:
+        return 0; //skip the body and SSL data
+    }
+    //log line by line without the NEWLINE, av_log would add one, 
+    //the query of the uri in the request line and text is stripped as in http_trace()
+    while(i < size){
+        int len = 0, in_query = 0;
+        for(; i < size && data[i] != '\n'; i++){
+            char c = data[i];
+            if(c == '?'){
+                in_query = 1;
+            }else if(c == ' ' || c == '\'' || c == '"'){
+                in_query = 0;
+            }
+            if(!in_query && c != '\r' && len < sizeof(line) - 1){
+                line[len++] = c;
+            }
+        }
+        i++; //skip the NEWLINE
+        if(len > 0){
+            line[len] = 0;
+            av_log(NULL, AV_LOG_INFO, "[cseg_ivr_writer] curl %s %s\n", dir, line);
+        }
+    }
+    return 0;
+}
+
+static int http_trace_setup(CURL * easyhandle, CachedSegmentContext * cseg)
+{
+    if(cseg->http_trace != CSEG_HTTP_TRACE_FULL){
+        return 0;
+    }
+    if(curl_easy_setopt(easyhandle, CURLOPT_DEBUGFUNCTION, http_debug_callback) ||
+       curl_easy_setopt(easyhandle, CURLOPT_VERBOSE, 1L)){
+        return AVERROR_EXTERNAL;
+    }
+    return 0;
+}
+
+/* log the timings of a finished HTTP request according to the trace level */
+static void http_trace(CURL * easyhandle, CachedSegmentContext * cseg,
+                       const char * method, const char * http_uri,
+                       CURLcode curl_res, long status, const char * err_str)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv *)cseg->writer_priv;
+    int failed = (curl_res != CURLE_OK || status >= 400);
+    uint32_t count = 0;
+    double dns = 0.0, connect = 0.0, tls = 0.0, ttfb = 0.0, total = 0.0;
+    char log_uri[MAX_URI_LEN];
+    
+    if(priv != NULL){
+        count = __sync_fetch_and_add(&priv->http_request_count, 1);
+    }
+    
+    switch(cseg->http_trace){
+    case CSEG_HTTP_TRACE_ERRORS:
+        if(!failed){
+            return;
+        }
+        break;
+    case CSEG_HTTP_TRACE_SAMPLED:
+        if(!failed && (count % cseg->http_trace_sample) != 0){
+            return;
+        }
+        break;
+    case CSEG_HTTP_TRACE_FULL:
+        break;
+    default:
+        return;
+    }
+    
+    curl_easy_getinfo(easyhandle, CURLINFO_NAMELOOKUP_TIME, &dns);
+    curl_easy_getinfo(easyhandle, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(easyhandle, CURLINFO_APPCONNECT_TIME, &tls);
+    curl_easy_getinfo(easyhandle, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+    curl_easy_getinfo(easyhandle, CURLINFO_TOTAL_TIME, &total);
+    
+    av_log(NULL, failed ? AV_LOG_WARNING : AV_LOG_INFO, 
+           "[cseg_ivr_writer] HTTP %s %s status:%ld curl:%d(%s) "
+           "dns:%.1fms connect:%.1fms tls:%.1fms ttfb:%.1fms total:%.1fms\n",
+           method, http_log_uri(http_uri, log_uri, sizeof(log_uri)), status, (int)curl_res, 
+           curl_res != CURLE_OK ? err_str : "ok",
+           dns * 1000, connect * 1000, tls * 1000, ttfb * 1000, total * 1000);
+}
+
 static int http_post(CURL * easyhandle,
+                     CachedSegmentContext * cseg,   //for statistics
                      char * http_uri, 
                      int32_t io_timeout,  //in milli-seconds 
                      char * post_content_type, 
                      char * post_data, int post_len,
-                     int32_t retries,
+                     HttpEndpoint * endpoint,
                      int * status_code,
                      char * result_buf, int *buf_size)
 {
@@ -152,12 +477,10 @@ static int http_post(CURL * easyhandle,
     HttpBuf http_buf;
     char err_buf[CURL_ERROR_SIZE] = "unknown";
     CURLcode curl_res = CURLE_OK;
+    int attempt, failed = -1;   // -1 if no attempt is made
 
     memset(&http_buf, 0, sizeof(HttpBuf));  
     
-    if(retries <= 0){
-        retries =  HTTP_DEFAULT_RETRY_NUM;       
-    }
 
 
     if(post_content_type != NULL){
@@ -194,12 +517,6 @@ static int http_post(CURL * easyhandle,
         goto fail;             
     }  
 
-    if(io_timeout > 0){
-        if(curl_easy_setopt(easyhandle, CURLOPT_TIMEOUT_MS , io_timeout)){
-            ret = AVERROR_EXTERNAL;
-            goto fail;                  
-        }
-    } 
     if(result_buf != NULL && buf_size != NULL && (*buf_size) != 0){
         http_buf.buf = result_buf;
         http_buf.buf_size = (*buf_size);
@@ -215,43 +532,65 @@ static int http_post(CURL * easyhandle,
         }
     }  
 
- #ifdef ENABLE_CURLOPT_VERBOSE   
-    if(curl_easy_setopt(easyhandle, CURLOPT_VERBOSE, 1)){
+    if(http_trace_setup(easyhandle, cseg)){
         ret = AVERROR_EXTERNAL;
         goto fail;               
-    }    
- #endif
+    }
+        
+    if(!breaker_allow(endpoint)){
+        ret = AVERROR(EAGAIN);
+        snprintf(err_buf, sizeof(err_buf), "%s endpoint circuit is open", endpoint->name);
+        goto fail;
+    }
+    retry_budget_deposit(endpoint->policy);
+    
+    for(attempt = 0; ; attempt++){
+        //each attempt is limited within the shutdown deadline
+        int32_t timeout = cseg_writer_timeout(cseg, io_timeout);
         
-    while(retries-- > 0){
         ret = 0;
+        status = 0;
         strcpy(err_buf, "unknown");
         http_buf.pos = 0;
         
-        if((curl_res = curl_easy_perform(easyhandle)) != CURLE_OK){
-            ret = AVERROR_EXTERNAL;            
-            if(curl_res == CURLE_OPERATION_TIMEDOUT ){
-                break;
-            }else{
-                //retry
-                random_msleep(); //sleep random 1 ~ 50 ms
-                continue;
-            }
+        if(timeout < 0){
+            ret = timeout;
+            strcpy(err_buf, "shutdown deadline expired");
+            break;
         }
-    
-        if(curl_easy_getinfo(easyhandle, CURLINFO_RESPONSE_CODE, &status)){
+        if(timeout > 0 && curl_easy_setopt(easyhandle, CURLOPT_TIMEOUT_MS, (long)timeout)){
             ret = AVERROR_EXTERNAL;
             break;
-        }    
+        }
         
+        if((curl_res = curl_easy_perform(easyhandle)) != CURLE_OK){
+            ret = AVERROR_EXTERNAL;            
+            cseg_stats_count_http(cseg, 0);
+            http_trace(easyhandle, cseg, "POST", http_uri, curl_res, 0, err_buf);
+        }else if(curl_easy_getinfo(easyhandle, CURLINFO_RESPONSE_CODE, &status)){
+            ret = AVERROR_EXTERNAL;
+        }else{
+            cseg_stats_count_http(cseg, status);
+            http_trace(easyhandle, cseg, "POST", http_uri, CURLE_OK, status, NULL);
+        }
+        
+        failed = (ret < 0 || http_status_retriable(endpoint, status));
+        if(!failed || !retry_backoff(cseg, endpoint, attempt)){
+            break;
+        }
+    }
+    if(failed >= 0){
+        breaker_report(endpoint, failed);
+    }
+    
+    if(ret == 0){
         if(status_code){
             *status_code = status;
         }
         if(buf_size != NULL){
             (*buf_size) = http_buf.pos;
         }
-
-        break;   // successful, then exit the loop
-    }//while(retries-- > 0){
+    }
     
     
 fail:    
@@ -269,11 +608,12 @@ fail:
 }
 
 static int http_put(CURL * easyhandle,
+                    CachedSegmentContext * cseg,   //for statistics
                     char * http_uri, 
                     int32_t io_timeout,  //in milli-seconds 
                     char * content_type, 
                     char * buf, int buf_size,
-                    int32_t retries,
+                    HttpEndpoint * endpoint,
                     int * status_code)
 {
     int ret = 0;
@@ -284,10 +624,8 @@ static int http_put(CURL * easyhandle,
     HttpBuf http_buf;
     char err_buf[CURL_ERROR_SIZE] = "unknown";   
     CURLcode curl_res = CURLE_OK; 
+    int attempt, failed = -1;   // -1 if no attempt is made
     
-    if(retries <= 0){
-        retries =  HTTP_DEFAULT_RETRY_NUM;       
-    }    
     
     memset(&http_buf, 0, sizeof(HttpBuf));
 
@@ -330,12 +668,6 @@ static int http_put(CURL * easyhandle,
         goto fail;                  
     }    
 
-    if(io_timeout > 0){
-        if(curl_easy_setopt(easyhandle, CURLOPT_TIMEOUT_MS , io_timeout)){
-            ret = AVERROR_EXTERNAL;
-            goto fail;                   
-        }
-    }   
     
     if(buf != NULL && buf_size != 0){
         http_buf.buf = buf;
@@ -353,41 +685,62 @@ static int http_put(CURL * easyhandle,
     }
     
         
-#ifdef ENABLE_CURLOPT_VERBOSE   
-    if(curl_easy_setopt(easyhandle, CURLOPT_VERBOSE, 1)){
+    if(http_trace_setup(easyhandle, cseg)){
         ret = AVERROR_EXTERNAL;
         goto fail;                    
-    }    
-#endif
+    }
 
-    while(retries-- > 0){
+    if(!breaker_allow(endpoint)){
+        ret = AVERROR(EAGAIN);
+        snprintf(err_buf, sizeof(err_buf), "%s endpoint circuit is open", endpoint->name);
+        goto fail;
+    }
+    retry_budget_deposit(endpoint->policy);
+    
+    for(attempt = 0; ; attempt++){
+        //each attempt is limited within the shutdown deadline
+        int32_t timeout = cseg_writer_timeout(cseg, io_timeout);
         
         ret = 0;
+        status = 0;
         strcpy(err_buf, "unknown");
-        http_buf.pos = 0;  
+        http_buf.pos = 0;
         
-        if((curl_res = curl_easy_perform(easyhandle)) != CURLE_OK){
-            ret = AVERROR_EXTERNAL;            
-            if(curl_res == CURLE_OPERATION_TIMEDOUT ){
-                break;
-            }else{
-                //retry
-                random_msleep(); //sleep random 1 ~ 50 ms
-                continue;
-            }
+        if(timeout < 0){
+            ret = timeout;
+            strcpy(err_buf, "shutdown deadline expired");
+            break;
         }
-    
-        if(curl_easy_getinfo(easyhandle, CURLINFO_RESPONSE_CODE, &status)){
+        if(timeout > 0 && curl_easy_setopt(easyhandle, CURLOPT_TIMEOUT_MS, (long)timeout)){
             ret = AVERROR_EXTERNAL;
             break;
-        }    
+        }
         
+        if((curl_res = curl_easy_perform(easyhandle)) != CURLE_OK){
+            ret = AVERROR_EXTERNAL;            
+            cseg_stats_count_http(cseg, 0);
+            http_trace(easyhandle, cseg, "PUT", http_uri, curl_res, 0, err_buf);
+        }else if(curl_easy_getinfo(easyhandle, CURLINFO_RESPONSE_CODE, &status)){
+            ret = AVERROR_EXTERNAL;
+        }else{
+            cseg_stats_count_http(cseg, status);
+            http_trace(easyhandle, cseg, "PUT", http_uri, CURLE_OK, status, NULL);
+        }
+        
+        failed = (ret < 0 || http_status_retriable(endpoint, status));
+        if(!failed || !retry_backoff(cseg, endpoint, attempt)){
+            break;
+        }
+    }
+    if(failed >= 0){
+        breaker_report(endpoint, failed);
+    }
+    
+    if(ret == 0){
         if(status_code){
             *status_code = status;
         }
-        
-        break;   // successful, then exit the loop
-    }//while(retries-- > 0){    
+    }
 fail:    
 
     if(ret < 0){
@@ -514,21 +867,59 @@ failed:
 }
 
 
+/* log the error info in the response of a failed request */
+static void log_response_error(IvrWriterPriv * priv, const char * op, int status_code,
+                               const char * response, int response_size)
+{
+    IvrJsonField field = {.key = IVR_ERR_INFO_FIELD_KEY};
+    char info[MAX_HTTP_RESULT_SIZE];
+    
+    if(response_size == 0){
+        return;
+    }
+    if(ivr_json_parse(response, response_size, &field, 1) < 0){
+        av_log(NULL, AV_LOG_ERROR, "[cseg_ivr_writer] HTTP %s file (%s) status code(%d):%s\n", 
+               op, priv->ivr_rest_uri, status_code, response);
+    }else if(ivr_json_get_string(&field, info, sizeof(info)) >= 0){
+        av_log(NULL, AV_LOG_ERROR, "[cseg_ivr_writer] HTTP %s file status code(%d):%s\n", 
+               op, status_code, info);
+    }
+}
+
+static void segment_file_info(CachedSegment *segment, IvrFileInfo *info)
+{
+    info->size = segment->size;
+    info->start = segment->start_ts;
+    info->duration = segment->duration;
+    info->next_dts = segment->next_dts;
+    info->degraded = segment->degraded;
+}
+
+/* 
+ * create a file with the given info, the last file (if any) is 
+ * finalized by IVR with this request. 
+ * easyhandle and response_buf are given by the caller, so that 
+ * it can be run along with the upload
+ */
 static int create_file(IvrWriterPriv * priv,
+                       CURL * easyhandle, 
+                       char * response_buf,
                        int32_t io_timeout, 
-                       CachedSegment *segment, 
+                       const char * last_filename,
+                       const IvrFileInfo *info, 
                        char * filename, int filename_size,
                        char * file_uri, int file_uri_size)
 {
     char post_data_str[MAX_POST_STR_LEN + 1];
-    char * http_response_json = priv->http_response_buf;
-    cJSON * json_root = NULL;
-    cJSON * json_name = NULL;
-    cJSON * json_uri = NULL;    
-    cJSON * json_info = NULL;        
+    char * http_response_json = response_buf;
+    IvrJsonField fields[2] = {
+        {.key = IVR_NAME_FIELD_KEY},
+        {.key = IVR_URI_FIELD_KEY},
+    };
     int ret;
     int status_code = 200;
     int response_size = MAX_HTTP_RESULT_SIZE - 1;
+    int len;
     
     if(filename_size){
         filename[0] = 0;
@@ -543,33 +934,33 @@ static int create_file(IvrWriterPriv * priv,
     //url_encode(checksum_b64_escape, checksum_b64);
 
     //prepare post_data
-    if(strlen(priv->last_filename) == 0){
-        snprintf(post_data_str,
-                MAX_POST_STR_LEN,
-                "op=create&content_type=video%%2Fmp2t&size=%d&start=%.6f&duration=%.6f&next_dts=%lld",
-                segment->size,
-                segment->start_ts, 
-                segment->duration,
-                (long long)segment->next_dts);  
-    }else{
-        snprintf(post_data_str, 
-                 MAX_POST_STR_LEN,
-                "op=create&content_type=video%%2Fmp2t&size=%d&start=%.6f&duration=%.6f&next_dts=%lld&last_file_name=%s",
-                segment->size,
-                segment->start_ts, 
-                segment->duration,
-                (long long)segment->next_dts,
-                priv->last_filename);          
+    len = snprintf(post_data_str,
+                   MAX_POST_STR_LEN,
+                   "op=create&content_type=video%%2Fmp2t&size=%d&start=%.6f&duration=%.6f&next_dts=%lld",
+                   info->size,
+                   info->start, 
+                   info->duration,
+                   (long long)info->next_dts);  
+    if(info->degraded && len < MAX_POST_STR_LEN){
+        len += snprintf(post_data_str + len, 
+                        MAX_POST_STR_LEN - len,
+                        "&degraded=1");
+    }
+    if(strlen(last_filename) != 0 && len < MAX_POST_STR_LEN){
+        len += snprintf(post_data_str + len, 
+                        MAX_POST_STR_LEN - len,
+                        "&last_file_name=%s",
+                        last_filename);          
     }
     post_data_str[MAX_POST_STR_LEN] = 0;
 
     //issue HTTP request
-    ret = http_post(priv->easyhandle,
+    ret = http_post(easyhandle, priv->cseg,
                     priv->ivr_rest_uri, 
                     io_timeout,
                     NULL, 
                     post_data_str, strlen(post_data_str), 
-                    HTTP_DEFAULT_RETRY_NUM,
+                    &priv->metadata_ep,
                     &status_code,
                     http_response_json, &response_size);
     if(ret){
@@ -580,24 +971,13 @@ static int create_file(IvrWriterPriv * priv,
     
     //parse the result
     if(status_code >= 200 && status_code < 300){
-        json_root = cJSON_Parse(http_response_json);
-        if(json_root== NULL){
+        if(ivr_json_parse(http_response_json, response_size, fields, 2) < 0){
             ret = AVERROR(EINVAL);
             av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP response Json parse failed(%s)\n", http_response_json);
             goto failed;
         }
-        json_name = cJSON_GetObjectItem(json_root, IVR_NAME_FIELD_KEY);
-        if(json_name && json_name->type == cJSON_String && json_name->valuestring){
-            av_strlcpy(filename, json_name->valuestring, filename_size);
-        }else{
-            ret = AVERROR(EINVAL);
-            av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP response Json for create file invalid(%s)\n", http_response_json);
-            goto failed;           
-        }
-        json_uri = cJSON_GetObjectItem(json_root, IVR_URI_FIELD_KEY);
-        if(json_uri && json_uri->type == cJSON_String && json_uri->valuestring){
-            av_strlcpy(file_uri, json_uri->valuestring, file_uri_size);
-        }else{
+        if(ivr_json_get_string(&fields[0], filename, filename_size) < 0 ||
+           ivr_json_get_string(&fields[1], file_uri, file_uri_size) < 0){
             ret = AVERROR(EINVAL);
             av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP response Json for create file invalid(%s)\n", http_response_json);
             goto failed;           
@@ -605,20 +985,8 @@ static int create_file(IvrWriterPriv * priv,
     }else{
 
         ret = http_status_to_av_code(status_code);
-        if(response_size != 0){
-            json_root = cJSON_Parse(http_response_json);
-            if(json_root== NULL){
-                av_log(NULL, AV_LOG_ERROR, "[cseg_ivr_writer] HTTP create file (%s) status code(%d):%s\n", 
-                       priv->ivr_rest_uri, status_code, http_response_json);
-            }else{
-                json_info = cJSON_GetObjectItem(json_root, IVR_ERR_INFO_FIELD_KEY);
-                if(json_info && json_info->type == cJSON_String && json_info->valuestring){            
-                    av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP create file status code(%d):%s\n", 
-                           status_code, json_info->valuestring);
-                }        
-            }//if(json_root== NULL)
-            
-        }//if(response_size != 0)
+        log_response_error(priv, "create", status_code, 
+                           http_response_json, response_size);
         av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] POST data:%s\n", 
                            post_data_str);
         goto failed;
@@ -627,11 +995,6 @@ static int create_file(IvrWriterPriv * priv,
     
 
 failed:
-    if(json_root){
-        cJSON_Delete(json_root); 
-        json_root = NULL;
-    }
-       
     return ret;
 }
 
@@ -649,27 +1012,14 @@ static int upload_file(IvrWriterPriv * priv,
     if(strncmp(file_uri, "http://", 7) == 0){
         //for http upload
     
-        ret = http_put(priv->easyhandle, 
+        ret = http_put(priv->easyhandle, priv->cseg,
                        file_uri, io_timeout, "video/mp2t",
                        segment->buffer, segment->size, 
-                       HTTP_DEFAULT_RETRY_NUM,
+                       &priv->storage_ep,
                        &status_code);
         if(ret){
             return ret;
         }
-        //Jam(2017-1-2): for some time, Aliyun OSS would return a error status for a normal operation, 
-        // but try again we can get the correct result
-        if(status_code >= 400){ //try to reconnect for one more time
-            random_msleep();        
-            ret = http_put(priv->easyhandle, 
-                       file_uri, io_timeout, "video/mp2t",
-                       segment->buffer, segment->size, 
-                       HTTP_DEFAULT_RETRY_NUM,
-                       &status_code);
-            if(ret){
-                return ret;
-            }
-        } 
         
         if(status_code < 200 || status_code >= 300){
             ret = http_status_to_av_code(status_code);
@@ -706,8 +1056,6 @@ static int save_file( IvrWriterPriv * priv,
     int status_code = 200;
     int ret = 0;
     char * http_response_json = priv->http_response_buf;
-    cJSON * json_root = NULL;
-    cJSON * json_info = NULL; 
     int response_size = MAX_HTTP_RESULT_SIZE - 1;    
     
     //prepare post_data
@@ -720,12 +1068,12 @@ static int save_file( IvrWriterPriv * priv,
     post_data_str[MAX_POST_STR_LEN] = 0;
     
     //issue HTTP request
-    ret = http_post(priv->easyhandle,
+    ret = http_post(priv->easyhandle, priv->cseg,
                     priv->ivr_rest_uri, 
                     io_timeout,
                     NULL, 
                     post_data_str, strlen(post_data_str), 
-                    HTTP_DEFAULT_RETRY_NUM,
+                    &priv->metadata_ep,
                     &status_code,
                     http_response_json, &response_size); 
     if(ret){
@@ -737,29 +1085,14 @@ static int save_file( IvrWriterPriv * priv,
     if(status_code < 200 || status_code >= 300){
 
         ret = http_status_to_av_code(status_code);
-        if(response_size != 0){
-            json_root = cJSON_Parse(http_response_json);
-            if(json_root== NULL){
-                av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP save file (%s) status code(%d):%s\n", 
-                       priv->ivr_rest_uri, status_code, http_response_json);                           
-            }else{
-                json_info = cJSON_GetObjectItem(json_root, IVR_ERR_INFO_FIELD_KEY);
-                if(json_info && json_info->type == cJSON_String && json_info->valuestring){
-                    av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP create file status code(%d):%s\n", 
-                       status_code, json_info->valuestring);
-                }        
-            }
-        }
+        log_response_error(priv, "save", status_code, 
+                           http_response_json, response_size);
         
         goto failed;
       
     }
 
 failed:
-    if(json_root){
-        cJSON_Delete(json_root); 
-        json_root = NULL;
-    }       
     return ret;
 }
 
@@ -769,8 +1102,7 @@ static int get_next_dts(IvrWriterPriv * priv,
 {
     char post_data_str[MAX_POST_STR_LEN + 1];
     char * http_response_json = priv->http_response_buf;
-    cJSON * json_root = NULL;
-    cJSON * json_next_dts = NULL;      
+    IvrJsonField field = {.key = IVR_NEXT_DTS_FIELD_KEY};
     int ret = 0;
     int status_code = 200;
     int response_size = MAX_HTTP_RESULT_SIZE - 1;
@@ -785,12 +1117,12 @@ static int get_next_dts(IvrWriterPriv * priv,
     post_data_str[MAX_POST_STR_LEN] = 0;
 
     //issue HTTP request
-    ret = http_post(priv->easyhandle,
+    ret = http_post(priv->easyhandle, priv->cseg,
                     priv->ivr_rest_uri, 
                     io_timeout,
                     NULL, 
                     post_data_str, strlen(post_data_str), 
-                    HTTP_DEFAULT_RETRY_NUM,
+                    &priv->metadata_ep,
                     &status_code,
                     http_response_json, &response_size);
     if(ret){
@@ -801,15 +1133,13 @@ static int get_next_dts(IvrWriterPriv * priv,
     
     //parse the result
     if(status_code >= 200 && status_code < 300){
-        json_root = cJSON_Parse(http_response_json);
-        if(json_root== NULL){
+        if(ivr_json_parse(http_response_json, response_size, &field, 1) < 0){
             ret = AVERROR(EINVAL);
             av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP response Json parse failed(%s)\n", http_response_json);
             goto failed;
         }
-        json_next_dts = cJSON_GetObjectItem(json_root, IVR_NEXT_DTS_FIELD_KEY);
-        if(json_next_dts && json_next_dts->type == cJSON_Number && json_next_dts->valuedouble > 0.1){
-            *next_dts = (int64_t)json_next_dts->valuedouble;
+        if(field.type == IVR_JSON_NUMBER && field.number > 0.1){
+            *next_dts = (int64_t)field.number;
         }
     }else{
         /* dts correction disabled */
@@ -819,16 +1149,89 @@ static int get_next_dts(IvrWriterPriv * priv,
     
 
 failed:
-    if(json_root){
-        cJSON_Delete(json_root); 
-        json_root = NULL;
-    }
-       
     return ret;
 }
 
 
 
+static void * create_ahead_routine(void * arg)
+{
+    IvrCreateAhead * ahead = (IvrCreateAhead *)arg;
+    
+    ahead->ret = create_file(ahead->priv, ahead->easyhandle, 
+                             ahead->http_response_buf,
+                             HTTP_REQUEST_TIMEOUT,
+                             ahead->last_filename,
+                             &ahead->info, 
+                             ahead->filename, MAX_FILE_NAME,
+                             ahead->file_uri, MAX_URI_LEN);
+    return NULL;
+}
+
+/* 
+ * start to create the file for the next segment, which finalizes 
+ * the current file (filename) being uploaded
+ */
+static void create_ahead_start(IvrWriterPriv * priv, CachedSegment *next, 
+                               const char * filename)
+{
+    IvrCreateAhead * ahead = &priv->ahead;
+    int ret;
+    
+    if(ahead->easyhandle == NULL && 
+       (ahead->easyhandle = curl_easy_init()) == NULL){
+        return; //create the next file after upload as usual
+    }
+    ahead->priv = priv;
+    ahead->sequence = next->sequence;
+    segment_file_info(next, &ahead->info);
+    av_strlcpy(ahead->last_filename, filename, MAX_FILE_NAME);
+    if((ret = pthread_create(&ahead->thread, NULL, create_ahead_routine, ahead))){
+        av_log(NULL, AV_LOG_WARNING, "[cseg_ivr_writer] pthread_create failed: %s\n", strerror(ret));
+        ahead->sequence = -1;
+        return;
+    }
+    ahead->running = 1;
+}
+
+/* wait for the create of the next file, return 1 if it's created */
+static int create_ahead_join(IvrWriterPriv * priv)
+{
+    IvrCreateAhead * ahead = &priv->ahead;
+    
+    if(!ahead->running){
+        return 0;
+    }
+    pthread_join(ahead->thread, NULL);
+    ahead->running = 0;
+    if(ahead->ret || strlen(ahead->filename) == 0 || strlen(ahead->file_uri) == 0){
+        ahead->sequence = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/* fail the file created ahead if it's not used by the next segment */
+static void create_ahead_discard(IvrWriterPriv * priv)
+{
+    IvrCreateAhead * ahead = &priv->ahead;
+    
+    if(ahead->sequence < 0){
+        return;
+    }
+    ahead->sequence = -1;
+    if(save_file(priv, HTTP_REQUEST_TIMEOUT, ahead->filename, 0)){
+        av_log(NULL, AV_LOG_WARNING, "[cseg_ivr_writer] cannot fail the file (%s) created ahead\n", 
+               ahead->filename);
+    }
+}
+
+static int ivr_get_next_dts(CachedSegmentContext *cseg, int64_t *next_dts)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv *)cseg->writer_priv;
+    return get_next_dts(priv, HTTP_REQUEST_TIMEOUT, next_dts);
+}
+
 static int ivr_init(CachedSegmentContext *cseg)
 {
     int ret = 0; 
@@ -874,13 +1277,18 @@ static int ivr_init(CachedSegmentContext *cseg)
         goto fail;
     }
     
+    priv->cseg = cseg;
+    retry_policy_init(&priv->retry_policy, cseg);
+    endpoint_init(&priv->metadata_ep, "metadata", &priv->retry_policy, 0);
+    //Jam(2017-1-2): for some time, Aliyun OSS would return a error status for a normal operation, 
+    // but try again we can get the correct result
+    endpoint_init(&priv->storage_ep, "storage", &priv->retry_policy, 1);
     priv->fallocate_size = cseg->fallocate_size;
     priv->cached_fd = -1;
+    priv->ahead.sequence = -1;
     
     cseg->writer_priv = priv;    
     
-    get_next_dts(priv, HTTP_REQUEST_TIMEOUT, &cseg->correct_start_dts);
-    
     return 0;
     
 fail:
@@ -904,45 +1312,99 @@ static int ivr_write_segment(CachedSegmentContext *cseg, CachedSegment *segment)
     IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
     char file_uri[MAX_URI_LEN];
     char filename[MAX_FILE_NAME];
-    char *p;
+    IvrFileInfo info;
+    CachedSegment * next = NULL;
     int ret = 0;
 
+    segment_file_info(segment, &info);
+    filename[0] = file_uri[0] = 0;
     
-    //get URI of the file for segment
-    ret = create_file(priv, 
-                      HTTP_REQUEST_TIMEOUT,
-                      segment, 
-                      filename, MAX_FILE_NAME,
-                      file_uri, MAX_URI_LEN);
-                      
-    if(ret){
+    if(priv->ahead.sequence == segment->sequence && !segment->spooled){
+        //created along with the upload of the last segment, which is finalized
+        av_strlcpy(filename, priv->ahead.filename, MAX_FILE_NAME);
+        av_strlcpy(file_uri, priv->ahead.file_uri, MAX_URI_LEN);
+        priv->ahead.sequence = -1;
+    }else{
+        //not written next, e.g. the live edge is taken first
+        create_ahead_discard(priv);
+    }
+    
+    if(strlen(priv->last_filename) != 0 && 
+       (segment->spooled || segment->sequence != priv->last_sequence + 1)){
+        //not the following segment (e.g. backfill after the live edge, or 
+        //spooled by a previous run whose sequences restart from start_number), 
+        //the last file cannot be finalized by the next create, save it alone
+        ret = save_file(priv, 
+                        HTTP_REQUEST_TIMEOUT,
+                        priv->last_filename, 1);
+        if(ret){
+            goto fail;
+        }
         priv->last_filename[0] = 0;
-        goto fail;
     }
     
-    priv->last_filename[0] = 0;      
+    if(strlen(filename) == 0){
+        //get URI of the file for segment
+        ret = create_file(priv, priv->easyhandle, 
+                          priv->http_response_buf,
+                          HTTP_REQUEST_TIMEOUT,
+                          priv->last_filename,
+                          &info, 
+                          filename, MAX_FILE_NAME,
+                          file_uri, MAX_URI_LEN);
+        priv->last_filename[0] = 0;
+        if(ret){
+            goto fail;
+        }
+    }
    
     if(strlen(filename) == 0 || strlen(file_uri) == 0){
-        ret = 1; //cannot upload at the moment
+        ret = CSEG_WRITER_PAUSE; //cannot upload at the moment
         //clear filename after create
           
     }else{    
         
+        //create the file of the next segment (if queued) during the upload, 
+        //to take the create off its path
+        if(cseg->writer_create_ahead && !segment->spooled){
+            next = cseg_next_cached_segment(cseg, segment);
+        }
+        if(next != NULL){
+            create_ahead_start(priv, next, filename);
+        }
+        
         //upload segment to the file URI
         ret = upload_file(priv, segment, 
                           cseg->writer_timeout,
                           filename,
                           file_uri);                      
-        if(ret == 0){
-            //Jam: store the successful filename to send at next create
-            strcpy(priv->last_filename, filename);
+        if(next != NULL){
+            create_ahead_join(priv);
+        }
+        if(ret == 0 && segment->spooled){
+            //not chained with the segments of this run
+            ret = save_file(priv, 
+                            HTTP_REQUEST_TIMEOUT,
+                            filename, 1);
+        }else if(ret == 0){
+            //Jam: store the successful filename to send at next create, 
+            //unless it's sent by the create ahead, which consumes it on failure 
+            //as the create after upload does
+            if(next == NULL){
+                strcpy(priv->last_filename, filename);
+            }
+            priv->last_sequence = segment->sequence;
 
         }else{
-            //fail the file, remove it from IVR
+            //fail the file, remove it from IVR, 
+            //even if it's finalized by the next create
             ret = save_file(priv, 
                             HTTP_REQUEST_TIMEOUT,
                             filename, 0);
             priv->last_filename[0] = 0;
+            if(ret == 0 && writer_circuit_open(priv)){
+                ret = CSEG_WRITER_BACKOFF; //storage is unavailable, keep the segment to upload later
+            }
     
         }//if(ret == 0){
             
@@ -952,7 +1414,16 @@ static int ivr_write_segment(CachedSegmentContext *cseg, CachedSegment *segment)
     }  
 
 fail:
-   
+    if(ret < 0 && writer_circuit_open(priv)){
+        //IVR or storage is unavailable, keep the segments in cache instead of dropping them
+        av_log(NULL, AV_LOG_WARNING, 
+               "[cseg_ivr_writer] circuit is open, pause writing segment\n");
+        ret = CSEG_WRITER_BACKOFF;
+    }
+    if(ret == CSEG_WRITER_PAUSE || ret == CSEG_WRITER_BACKOFF){
+        //resume as soon as the open circuit can be probed
+        cseg->writer_resume_hint = writer_resume_delay(priv);
+    }
     return ret;
 }
 
@@ -967,12 +1438,18 @@ static void ivr_uninit(CachedSegmentContext *cseg)
                       priv->last_filename, 1);   
             priv->last_filename[0] = 0;
         }
+        create_ahead_discard(priv);
 
         if(priv->easyhandle != NULL){
             curl_easy_cleanup(priv->easyhandle); 
             priv->easyhandle = NULL;
         }
+        if(priv->ahead.easyhandle != NULL){
+            curl_easy_cleanup(priv->ahead.easyhandle); 
+            priv->ahead.easyhandle = NULL;
+        }
         close_cached_file(priv);
+        pthread_mutex_destroy(&priv->retry_policy.mutex);
         
         av_free(priv);  
         cseg->writer_priv = NULL;      
@@ -988,6 +1465,7 @@ CachedSegmentWriter cseg_ivr_writer = {
     .protos         = "ivr", 
     .init           = ivr_init, 
     .write_segment  = ivr_write_segment, 
+    .get_next_dts   = ivr_get_next_dts,
     .uninit         = ivr_uninit,
 };
 
@@ -0,0 +1,117 @@
+/**
+ * This file is part of ffmpeg_ivr
+ * 
+ * Copyright (C) 2016  OpenSight (www.opensight.cn)
+ * 
+ * ffmpeg_ivr is an extension of ffmpeg to implements the new feature for IVR
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**/
+
+/*
+ * Micro-benchmark of the IVR response parsing: cJSON vs ivr_json.
+ * It is not part of the build, compile it by hand in this directory:
+ *
+ *   gcc -O2 -I.. -I<ffmpeg include dir> ivr_json_bench.c ../ivr_json.c ../cJSON.c -lm
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "cJSON.h"
+#include "ivr_json.h"
+
+#define LOOPS 1000000
+
+static const char *responses[] = {
+    "{\"name\": \"20161203T102030_000012.ts\", "
+    "\"uri\": \"http://storage.example.com/bucket/camera_1/20161203T102030_000012.ts?sign=a8f7c6d5e4\"}",
+    "{\"info\": \"the file (20161203T102030_000012.ts) is not found\"}",
+    "{\"next_dts\": 1480760430123, \"extra\": {\"a\": [1, 2, {\"b\": null}]}, \"ok\": true}",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_cjson(const char *json, char *name, char *uri, char *info, double *next_dts)
+{
+    cJSON *root = cJSON_Parse(json);
+    cJSON *item;
+    if(root == NULL){
+        return -1;
+    }
+    if((item = cJSON_GetObjectItem(root, "name")) && item->type == cJSON_String)
+        strcpy(name, item->valuestring);
+    if((item = cJSON_GetObjectItem(root, "uri")) && item->type == cJSON_String)
+        strcpy(uri, item->valuestring);
+    if((item = cJSON_GetObjectItem(root, "info")) && item->type == cJSON_String)
+        strcpy(info, item->valuestring);
+    if((item = cJSON_GetObjectItem(root, "next_dts")) && item->type == cJSON_Number)
+        *next_dts = item->valuedouble;
+    cJSON_Delete(root);
+    return 0;
+}
+
+static int parse_ivr_json(const char *json, char *name, char *uri, char *info, double *next_dts)
+{
+    IvrJsonField fields[4] = {
+        {.key = "name"}, {.key = "uri"}, {.key = "info"}, {.key = "next_dts"},
+    };
+    if(ivr_json_parse(json, strlen(json), fields, 4) < 0){
+        return -1;
+    }
+    ivr_json_get_string(&fields[0], name, 256);
+    ivr_json_get_string(&fields[1], uri, 1024);
+    ivr_json_get_string(&fields[2], info, 256);
+    if(fields[3].type == IVR_JSON_NUMBER)
+        *next_dts = fields[3].number;
+    return 0;
+}
+
+int main(void)
+{
+    char name[2][256], uri[2][1024], info[2][256];
+    double next_dts[2];
+    int i, j;
+    
+    for(i = 0; i < sizeof(responses) / sizeof(responses[0]); i++){
+        double t0, t1, t2;
+        
+        memset(name, 0, sizeof(name)); memset(uri, 0, sizeof(uri)); 
+        memset(info, 0, sizeof(info)); next_dts[0] = next_dts[1] = 0.0;
+        parse_cjson(responses[i], name[0], uri[0], info[0], &next_dts[0]);
+        parse_ivr_json(responses[i], name[1], uri[1], info[1], &next_dts[1]);
+        if(strcmp(name[0], name[1]) || strcmp(uri[0], uri[1]) || 
+           strcmp(info[0], info[1]) || next_dts[0] != next_dts[1]){
+            printf("response %d: results mismatch\n", i);
+            return 1;
+        }
+        
+        t0 = now();
+        for(j = 0; j < LOOPS; j++)
+            parse_cjson(responses[i], name[0], uri[0], info[0], &next_dts[0]);
+        t1 = now();
+        for(j = 0; j < LOOPS; j++)
+            parse_ivr_json(responses[i], name[1], uri[1], info[1], &next_dts[1]);
+        t2 = now();
+        printf("response %d: cJSON %.1f ns/op, ivr_json %.1f ns/op\n", i,
+               (t1 - t0) * 1e9 / LOOPS, (t2 - t1) * 1e9 / LOOPS);
+    }
+    return 0;
+}
@@ -543,8 +543,10 @@ int parse_log_rotate(int argc, char **argv, const OptionDef *options)
     char * params = NULL;
     char * p =NULL;
     char * base_name_p = NULL, * file_size_p = NULL, * rotate_num_p = NULL;
+    char * time_format_p = NULL;
     int file_size = 0;
     int rotate_num = 0;
+    int time_format = ROTATE_LOGGER_TIME_CTIME;
     int ret = 0;
     
     if (idx == 0 || argv[idx + 1] == NULL){
@@ -578,9 +580,28 @@ int parse_log_rotate(int argc, char **argv, const OptionDef *options)
         ret = -1;
         goto end;
     }
+    p = strchr(p, ':');
+    if(p){
+        //optional time format
+        *p = 0;
+        p++;
+        time_format_p = p;
+    }
     rotate_num = strtol(rotate_num_p, NULL, 0);
+    if(time_format_p != NULL){
+        if(!strcmp(time_format_p, "ctime")){
+            time_format = ROTATE_LOGGER_TIME_CTIME;
+        }else if(!strcmp(time_format_p, "ms")){
+            time_format = ROTATE_LOGGER_TIME_MS;
+        }else if(!strcmp(time_format_p, "iso8601")){
+            time_format = ROTATE_LOGGER_TIME_ISO8601;
+        }else{
+            ret = -1;
+            goto end;
+        }
+    }
     
-    ret = rotate_logger_init(base_name_p, file_size, rotate_num);
+    ret = rotate_logger_init(base_name_p, file_size, rotate_num, time_format);
     if(ret){
         goto end;
     }
@@ -19,7 +19,7 @@
     { "colors"     , OPT_EXIT, {.func_arg = show_colors },      "show available color names" },
     { "loglevel"   , HAS_ARG,  {.func_arg = opt_loglevel},      "set logging level", "loglevel" },
 #ifdef FFMPEG_IVR    
-    { "log_rotate" , HAS_ARG,  {.func_arg = opt_null},      "set auto-rotate logger params", "FILENAME:SIZE:ROTATE_NUM" },    
+    { "log_rotate" , HAS_ARG,  {.func_arg = opt_null},      "set auto-rotate logger params", "FILENAME:SIZE:ROTATE_NUM[:ctime|ms|iso8601]" },    
 #endif
     { "v",           HAS_ARG,  {.func_arg = opt_loglevel},      "set logging level", "loglevel" },
     { "report"     , 0,        {(void*)opt_report}, "generate a report" },
@@ -121,9 +121,11 @@
 
 
 #ifdef FFMPEG_IVR
+#include "libavutil/random_seed.h"
 #include "ivr_compat.h"
 #include "libffmpeg_ivr.h"
 #include "ivr_rotate_logger.h"
+#include "ivr_latency.h"
 #endif
 
 #ifdef FFMPEG_IVR
@@ -182,6 +184,9 @@ static int restore_tty;
 
 #if HAVE_PTHREADS
 static void free_input_threads(void);
+#ifdef FFMPEG_IVR
+static void free_input_standby(int file_index);
+#endif
 #endif
 
 /* sub2video hack:
@@ -342,6 +347,9 @@ static volatile int received_nb_signals = 0;
 static volatile int transcode_init_done = 0;
 static volatile int ffmpeg_exited = 0;
 static int main_return_code = 0;
+#ifdef FFMPEG_IVR
+static volatile sig_atomic_t received_event_signal = 0;
+#endif
 
 static void
 sigterm_handler(int sig)
@@ -357,6 +365,14 @@ sigterm_handler(int sig)
     }
 }
 
+#if defined(FFMPEG_IVR) && defined(SIGUSR1)
+/* SIGUSR1 starts an event of the cseg outputs, SIGUSR2 stops it */
+static void event_signal_handler(int sig)
+{
+    received_event_signal = sig;
+}
+#endif
+
 #if HAVE_SETCONSOLECTRLHANDLER
 static BOOL WINAPI CtrlHandler(DWORD fdwCtrlType)
 {
@@ -485,17 +501,24 @@ int input_interrupt_cb(void *arg)
     if(received_nb_signals > transcode_init_done){
         return 1;
     }
+    if(f != NULL && f->standby_abort){
+        return 1;
+    }
     
-    if(input_io_timeout > 0 && f != NULL && f->io_start_ts.tv_sec != 0){
-        struct timespec cur_ts;
-        clock_gettime(CLOCK_MONOTONIC, &cur_ts);
-        uint64_t io_dur = (cur_ts.tv_sec - f->io_start_ts.tv_sec) * 1000 +
-              (cur_ts.tv_nsec - f->io_start_ts.tv_nsec) / 1000000;       
-        if(io_dur >= (uint64_t)input_io_timeout){
-            av_log(NULL, AV_LOG_ERROR, "Input IO Timeout( >=%d ms)\n", input_io_timeout);
+#if HAVE_PTHREADS
+    /* the deadline is checked by the IO watchdog */
+    if(f != NULL){
+        unsigned gen = __atomic_load_n(&f->io_gen, __ATOMIC_ACQUIRE);
+        if((gen & 1) && __atomic_load_n(&f->io_expired, __ATOMIC_ACQUIRE) == gen)
             return 1;
-        }
-    }    
+    }
+#else
+    if(input_io_timeout > 0 && f != NULL && (__atomic_load_n(&f->io_gen, __ATOMIC_ACQUIRE) & 1) &&
+       ivr_latency_now() - f->io_start_us >= input_io_timeout * 1000LL){
+        av_log(NULL, AV_LOG_ERROR, "Input IO Timeout( >=%d ms)\n", input_io_timeout);
+        return 1;
+    }
+#endif
     return 0;
 }
 #endif
@@ -584,9 +607,20 @@ static void ffmpeg_cleanup(int ret)
     }
 #if HAVE_PTHREADS
     free_input_threads();
+#endif
+#if defined(FFMPEG_IVR) && HAVE_PTHREADS
+    input_watchdog_stop();
 #endif
     for (i = 0; i < nb_input_files; i++) {
         avformat_close_input(&input_files[i]->ctx);
+#if defined(FFMPEG_IVR) && HAVE_PTHREADS
+        /* after the input, which may be a standby taken over */
+        free_input_standby(i);
+#endif
+#ifdef FFMPEG_IVR
+        av_dict_free(&input_files[i]->format_opts);
+        av_freep(&input_files[i]->backup_urls);
+#endif
         av_freep(&input_files[i]);
     }
     for (i = 0; i < nb_input_streams; i++) {
@@ -608,6 +642,9 @@ static void ffmpeg_cleanup(int ret)
     if (vstats_file)
         fclose(vstats_file);
     av_freep(&vstats_filename);
+#ifdef FFMPEG_IVR
+    av_freep(&stats_file);
+#endif
 
     av_freep(&input_streams);
     av_freep(&input_files);
@@ -686,6 +723,16 @@ static void write_frame(AVFormatContext *s, AVPacket *pkt, OutputStream *ost)
     AVBitStreamFilterContext *bsfc = ost->bitstream_filters;
     AVCodecContext          *avctx = ost->encoding_needed ? ost->enc_ctx : ost->st->codec;
     int ret;
+#ifdef FFMPEG_IVR
+    int64_t mux_start = 0;
+
+    if (ivr_latency_enabled) {
+        mux_start = ivr_latency_now();
+        /* with a single input the packet being copied is the one just read */
+        if (ost->stream_copy && nb_input_files == 1 && input_files[0]->io_done_us)
+            ivr_latency_record(IVR_LATENCY_DISPATCH, mux_start - input_files[0]->io_done_us);
+    }
+#endif
 
     if (!ost->st->codec->extradata_size && ost->enc_ctx->extradata_size) {
         ost->st->codec->extradata = av_mallocz(ost->enc_ctx->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
@@ -853,8 +900,17 @@ FF_ENABLE_DEPRECATION_WARNINGS
             cur_sec = cur_ts.tv_sec;
         }
     }
+#endif
+#ifdef FFMPEG_IVR
+    if (output_files[ost->file_index]->remux_fast_path)
+        ret = av_write_frame(s, pkt);
+    else
 #endif
     ret = av_interleaved_write_frame(s, pkt);
+#ifdef FFMPEG_IVR
+    if (mux_start)
+        ivr_latency_record(IVR_LATENCY_MUX, ivr_latency_now() - mux_start);
+#endif
     if (ret < 0) {
         print_error("av_interleaved_write_frame()", ret);
         main_return_code = 1;
@@ -863,6 +919,27 @@ FF_ENABLE_DEPRECATION_WARNINGS
     av_free_packet(pkt);
 }
 
+#ifdef FFMPEG_IVR
+/*
+ * A cseg output which is fed by plain stream copies of a single input
+ * receives the packets in demux order already, so it can bypass the
+ * interleaving queue (one allocation per packet) of libavformat.
+ */
+static int check_remux_fast_path(OutputFile *of)
+{
+    int i;
+
+    if (nb_input_files != 1 || strcmp(of->ctx->oformat->name, "cseg"))
+        return 0;
+    for (i = 0; i < of->ctx->nb_streams; i++) {
+        OutputStream *ost = output_streams[of->ost_index + i];
+        if (!ost->stream_copy || ost->bitstream_filters)
+            return 0;
+    }
+    return 1;
+}
+#endif
+
 static void close_output_stream(OutputStream *ost)
 {
     OutputFile *of = output_files[ost->file_index];
@@ -1961,6 +2038,15 @@ static void do_streamcopy(InputStream *ist, OutputStream *ost, const AVPacket *p
         opkt.data = pkt->data;
         opkt.size = pkt->size;
     }
+#ifdef FFMPEG_IVR
+    /* share the demuxer buffer when the payload is passed through as is,
+     * so that no muxer down the chain has to duplicate it */
+    if (!opkt.buf && pkt->buf && opkt.data == pkt->data) {
+        opkt.buf = av_buffer_ref(pkt->buf);
+        if (!opkt.buf)
+            exit_program(1);
+    }
+#endif
     av_copy_packet_side_data(&opkt, pkt);
 
     if (ost->st->codec->codec_type == AVMEDIA_TYPE_VIDEO &&
@@ -3289,6 +3375,9 @@ static int transcode_init(void)
             goto dump_format;
         }
 //         assert_avoptions(output_files[i]->opts);
+#ifdef FFMPEG_IVR
+        output_files[i]->remux_fast_path = check_remux_fast_path(output_files[i]);
+#endif
         if (strcmp(oc->oformat->name, "rtp")) {
             want_sdp = 0;
         }
@@ -3556,15 +3645,137 @@ static int check_keyboard_interaction(int64_t cur_time)
 #ifdef FFMPEG_IVR
 void input_start_io(InputFile *f)
 {
-    clock_gettime(CLOCK_MONOTONIC, &(f->io_start_ts));
-    
+#if HAVE_PTHREADS
+    if(ivr_latency_enabled)
+#endif
+        f->io_start_us = ivr_latency_now();
+    __atomic_add_fetch(&f->io_gen, 1, __ATOMIC_RELEASE);
 }
 void input_stop_io(InputFile *f)
 {
-    f->io_start_ts.tv_sec = 0;
-    f->io_start_ts.tv_nsec = 0;
+    //only the packet reading is counted, not the opening/probing
+    if(ivr_latency_enabled && f->ctx != NULL && f->io_start_us != 0){
+        f->io_done_us = ivr_latency_now();
+        ivr_latency_record(IVR_LATENCY_READ, f->io_done_us - f->io_start_us);
+    }
+    f->io_start_us = 0;
+    __atomic_add_fetch(&f->io_gen, 1, __ATOMIC_RELEASE);
+}
+
+#if HAVE_PTHREADS
+/*
+ * The IO watchdog shared by all the inputs.
+ *
+ * input_start_io()/input_stop_io() only bump f->io_gen, odd while an IO
+ * is in progress. The watchdog thread samples the generations every tick
+ * and marks the one that has not moved for input_io_timeout ms as
+ * expired, so the interrupt callback needs no clock read.
+ */
+typedef struct WatchdogEntry {
+    InputFile *f;
+    unsigned gen;       /* the last generation seen */
+    int64_t since;      /* when gen is first seen */
+} WatchdogEntry;
+
+static WatchdogEntry *watchdog_entries;
+static int nb_watchdog_entries;
+static pthread_t watchdog_tid;
+static pthread_mutex_t watchdog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watchdog_cond;    /* bound to CLOCK_MONOTONIC when the thread starts */
+static int watchdog_running;
+static int watchdog_abort;
+
+static void *watchdog_thread(void *arg)
+{
+    /* a timeout fires between input_io_timeout and one tick later */
+    int64_t tick = av_clip(input_io_timeout / 10, 1, 100) * 1000;
+    int i;
+
+    pthread_mutex_lock(&watchdog_mutex);
+    while (!watchdog_abort) {
+        int64_t now = av_gettime_relative();
+        struct timespec ts;
+
+        for (i = 0; i < nb_watchdog_entries; i++) {
+            WatchdogEntry *e = &watchdog_entries[i];
+            unsigned gen = __atomic_load_n(&e->f->io_gen, __ATOMIC_ACQUIRE);
+            if (gen != e->gen) {
+                e->gen = gen;
+                e->since = now;
+            } else if ((gen & 1) && __atomic_load_n(&e->f->io_expired, __ATOMIC_RELAXED) != gen &&
+                       now - e->since >= input_io_timeout * 1000LL) {
+                __atomic_store_n(&e->f->io_expired, gen, __ATOMIC_RELEASE);
+                av_log(NULL, AV_LOG_ERROR, "Input IO Timeout( >=%d ms)\n", input_io_timeout);
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &ts); // watchdog_cond is bound to CLOCK_MONOTONIC
+        ts.tv_nsec += tick * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&watchdog_cond, &watchdog_mutex, &ts);
+    }
+    pthread_mutex_unlock(&watchdog_mutex);
+    return NULL;
+}
+
+/* watch the IO of f against input_io_timeout, the thread is started on the first one */
+int input_watchdog_add(InputFile *f)
+{
+    WatchdogEntry *entries;
+    int ret = 0;
+
+    pthread_mutex_lock(&watchdog_mutex);
+    entries = av_realloc_array(watchdog_entries, nb_watchdog_entries + 1, sizeof(*entries));
+    if (!entries) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    watchdog_entries = entries;
+    entries[nb_watchdog_entries].f     = f;
+    entries[nb_watchdog_entries].gen   = __atomic_load_n(&f->io_gen, __ATOMIC_ACQUIRE);
+    entries[nb_watchdog_entries].since = av_gettime_relative();
+    nb_watchdog_entries++;
+
+    if (!watchdog_running) {
+        //the ticks should not be affected by the system time change
+        pthread_condattr_t cond_attr;
+        pthread_condattr_init(&cond_attr);
+        pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&watchdog_cond, &cond_attr);
+        pthread_condattr_destroy(&cond_attr);
+        if ((ret = pthread_create(&watchdog_tid, NULL, watchdog_thread, NULL))) {
+            av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s\n", strerror(ret));
+            pthread_cond_destroy(&watchdog_cond);
+            nb_watchdog_entries--;
+            ret = AVERROR(ret);
+            goto end;
+        }
+        watchdog_running = 1;
+    }
+end:
+    pthread_mutex_unlock(&watchdog_mutex);
+    return ret;
+}
+
+void input_watchdog_stop(void)
+{
+    if (watchdog_running) {
+        pthread_mutex_lock(&watchdog_mutex);
+        watchdog_abort = 1;
+        pthread_cond_signal(&watchdog_cond);
+        pthread_mutex_unlock(&watchdog_mutex);
+        pthread_join(watchdog_tid, NULL);
+        pthread_cond_destroy(&watchdog_cond);
+        watchdog_running = 0;
+    }
+    av_freep(&watchdog_entries);
+    nb_watchdog_entries = 0;
 }
 #endif
+#endif
 
 
 #if HAVE_PTHREADS
@@ -3616,24 +3827,50 @@ static void *input_thread(void *arg)
     return NULL;
 }
 
+static void free_input_thread(int i)
+{
+    InputFile *f = input_files[i];
+    AVPacket pkt;
+
+    if (!f || !f->in_thread_queue)
+        return;
+    av_thread_message_queue_set_err_send(f->in_thread_queue, AVERROR_EOF);
+    while (av_thread_message_queue_recv(f->in_thread_queue, &pkt, 0) >= 0)
+        av_free_packet(&pkt);
+
+    pthread_join(f->thread, NULL);
+    f->joined = 1;
+    av_thread_message_queue_free(&f->in_thread_queue);
+}
+
 static void free_input_threads(void)
 {
     int i;
 
-    for (i = 0; i < nb_input_files; i++) {
-        InputFile *f = input_files[i];
-        AVPacket pkt;
+    for (i = 0; i < nb_input_files; i++)
+        free_input_thread(i);
+}
 
-        if (!f || !f->in_thread_queue)
-            continue;
-        av_thread_message_queue_set_err_send(f->in_thread_queue, AVERROR_EOF);
-        while (av_thread_message_queue_recv(f->in_thread_queue, &pkt, 0) >= 0)
-            av_free_packet(&pkt);
+static int init_input_thread(int i)
+{
+    int ret;
+    InputFile *f = input_files[i];
 
-        pthread_join(f->thread, NULL);
-        f->joined = 1;
+    if (f->ctx->pb ? !f->ctx->pb->seekable :
+        strcmp(f->ctx->iformat->name, "lavfi"))
+        f->non_blocking = 1;
+    ret = av_thread_message_queue_alloc(&f->in_thread_queue,
+                                        f->thread_queue_size, sizeof(AVPacket));
+    if (ret < 0)
+        return ret;
+
+    if ((ret = pthread_create(&f->thread, NULL, input_thread, f))) {
+        av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
         av_thread_message_queue_free(&f->in_thread_queue);
+        return AVERROR(ret);
     }
+    f->joined = 0;
+    return 0;
 }
 
 static int init_input_threads(void)
@@ -3644,21 +3881,9 @@ static int init_input_threads(void)
         return 0;
 
     for (i = 0; i < nb_input_files; i++) {
-        InputFile *f = input_files[i];
-
-        if (f->ctx->pb ? !f->ctx->pb->seekable :
-            strcmp(f->ctx->iformat->name, "lavfi"))
-            f->non_blocking = 1;
-        ret = av_thread_message_queue_alloc(&f->in_thread_queue,
-                                            f->thread_queue_size, sizeof(AVPacket));
+        ret = init_input_thread(i);
         if (ret < 0)
             return ret;
-
-        if ((ret = pthread_create(&f->thread, NULL, input_thread, f))) {
-            av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
-            av_thread_message_queue_free(&f->in_thread_queue);
-            return AVERROR(ret);
-        }
     }
     return 0;
 }
@@ -3719,6 +3944,543 @@ static void reset_eagain(void)
         output_streams[i]->unavailable = 0;
 }
 
+#ifdef FFMPEG_IVR
+/* check if the parameters are known without avformat_find_stream_info() */
+static int input_params_known(AVFormatContext *ic)
+{
+    int i;
+
+    for (i = 0; i < ic->nb_streams; i++) {
+        AVCodecContext *avctx = ic->streams[i]->codec;
+        if (avctx->codec_id == AV_CODEC_ID_NONE)
+            return 0;
+        if (avctx->codec_type == AVMEDIA_TYPE_VIDEO &&
+            (!avctx->width || !avctx->height))
+            return 0;
+        if (avctx->codec_type == AVMEDIA_TYPE_AUDIO &&
+            (!avctx->sample_rate || !avctx->channels))
+            return 0;
+    }
+    return 1;
+}
+
+/* the reopened input must carry the same streams for the running outputs */
+static int check_input_compatible(InputFile *ifile, AVFormatContext *ic)
+{
+    int i;
+
+    if (ic->nb_streams < ifile->nb_streams) {
+        av_log(NULL, AV_LOG_ERROR, "Reconnected input has %d streams, %d expected\n",
+               ic->nb_streams, ifile->nb_streams);
+        return AVERROR(EINVAL);
+    }
+    for (i = 0; i < ifile->nb_streams; i++) {
+        AVCodecContext *old = ifile->ctx->streams[i]->codec;
+        AVCodecContext *new = ic->streams[i]->codec;
+
+        if (old->codec_type != new->codec_type || old->codec_id != new->codec_id ||
+            (old->codec_type == AVMEDIA_TYPE_VIDEO &&
+             (old->width != new->width || old->height != new->height)) ||
+            (old->codec_type == AVMEDIA_TYPE_AUDIO &&
+             (old->sample_rate != new->sample_rate || old->channels != new->channels))) {
+            av_log(NULL, AV_LOG_ERROR, "Codec parameters of stream #%d changed after reconnected\n", i);
+            return AVERROR(EINVAL);
+        }
+    }
+    return 0;
+}
+
+/*
+ * open the input url with the settings of the template tmpl and the options of f,
+ * the IO is timed on f unless untimed, the streams are probed only if unknown
+ */
+static int open_input_context(InputFile *f, int untimed, AVFormatContext *tmpl, 
+                              const char *url, AVInputFormat *iformat, AVFormatContext **pic)
+{
+    AVFormatContext *ic;
+    AVDictionary *format_opts = NULL;
+    int ret;
+
+    ic = avformat_alloc_context();
+    if (!ic)
+        return AVERROR(ENOMEM);
+    ic->video_codec_id    = tmpl->video_codec_id;
+    ic->audio_codec_id    = tmpl->audio_codec_id;
+    ic->subtitle_codec_id = tmpl->subtitle_codec_id;
+    ic->data_codec_id     = tmpl->data_codec_id;
+    av_format_set_video_codec   (ic, av_format_get_video_codec(tmpl));
+    av_format_set_audio_codec   (ic, av_format_get_audio_codec(tmpl));
+    av_format_set_subtitle_codec(ic, av_format_get_subtitle_codec(tmpl));
+    av_format_set_data_codec    (ic, av_format_get_data_codec(tmpl));
+    ic->flags |= AVFMT_FLAG_NONBLOCK;
+    ic->interrupt_callback = tmpl->interrupt_callback;
+
+    av_dict_copy(&format_opts, f->format_opts, 0);
+    if (!untimed)
+        input_start_io(f);
+    ret = avformat_open_input(&ic, url, iformat, &format_opts);
+    if (!untimed)
+        input_stop_io(f);
+    av_dict_free(&format_opts);
+    if (ret < 0)
+        return ret;
+
+    /* a live input usually describes its streams in the session, skip the probe then */
+    if (!input_params_known(ic)) {
+        if (!untimed)
+            input_start_io(f);
+        ret = avformat_find_stream_info(ic, NULL);
+        if (!untimed)
+            input_stop_io(f);
+        if (ret < 0) {
+            avformat_close_input(&ic);
+            return ret;
+        }
+    }
+    *pic = ic;
+    return 0;
+}
+
+/* replace the demuxer of the input by the compatible ic, the decoders and outputs are kept */
+static void replace_input_context(InputFile *ifile, AVFormatContext *ic)
+{
+    AVFormatContext *old = ifile->ctx;
+    int i;
+
+    for (i = 0; i < ic->nb_streams; i++) {
+        InputStream *ist;
+        AVCodecContext *old_codec, *new_codec;
+
+        if (i >= ifile->nb_streams) {
+            ic->streams[i]->discard = AVDISCARD_ALL;
+            continue;
+        }
+        ist = input_streams[ifile->ist_index + i];
+        old_codec = ist->st->codec;
+        new_codec = ic->streams[i]->codec;
+        ic->streams[i]->discard = ist->st->discard;
+        ist->wait_keyframe = new_codec->codec_type == AVMEDIA_TYPE_VIDEO;
+        ist->new_extradata = new_codec->extradata_size &&
+                             (new_codec->extradata_size != old_codec->extradata_size ||
+                              memcmp(new_codec->extradata, old_codec->extradata, new_codec->extradata_size));
+        ist->wrap_correction_done = 0;
+        ist->st = ic->streams[i];
+    }
+    ifile->ctx = ic;
+    avformat_close_input(&old);
+}
+
+/* the timestamps of the input continue from, in AV_TIME_BASE */
+static int64_t input_last_ts(InputFile *ifile)
+{
+    int64_t last_ts = AV_NOPTS_VALUE;
+    int i;
+
+    for (i = 0; i < ifile->nb_streams; i++) {
+        InputStream *ist = input_streams[ifile->ist_index + i];
+        if (ist->next_dts != AV_NOPTS_VALUE &&
+            (last_ts == AV_NOPTS_VALUE || ist->next_dts > last_ts))
+            last_ts = ist->next_dts;
+    }
+    return last_ts;
+}
+
+/* go on reading the input with the new demuxer, keeping the outage as a timestamp gap */
+static int resume_input_file(int file_index, int64_t last_ts, int64_t lost_time)
+{
+    InputFile *ifile = input_files[file_index];
+    int ret;
+
+#if HAVE_PTHREADS
+    if (nb_input_files > 1 && (ret = init_input_thread(file_index)) < 0)
+        return ret;
+#endif
+
+    if (last_ts != AV_NOPTS_VALUE) {
+        ifile->reconnected  = 1;
+        ifile->reconnect_ts = last_ts + (av_gettime_relative() - lost_time);
+    }
+    ifile->eof_reached = 0;
+    ifile->eagain = 0;
+    av_log(NULL, AV_LOG_WARNING, "Input #%d resumed with %s after %"PRId64" ms\n",
+           file_index, ifile->ctx->filename, (av_gettime_relative() - lost_time) / 1000);
+    return 0;
+}
+
+/* only a live input is reconnected, a file is finished at its end */
+static int input_is_live(InputFile *ifile)
+{
+    AVFormatContext *ic = ifile->ctx;
+
+    return ic->pb ? !ic->pb->seekable : strcmp(ic->iformat->name, "lavfi");
+}
+
+/*
+ * reopen the lost input with backoff, one attempt per call, so that the
+ * other inputs and the outputs (e.g. cseg with its cache) keep running
+ * in the meanwhile, and the timestamps go on across the outage.
+ * return 0 if reconnected, AVERROR(EAGAIN) if to be tried again later,
+ * another error if given up
+ */
+static int reconnect_input_file(int file_index)
+{
+    InputFile *ifile = input_files[file_index];
+    AVFormatContext *ic = NULL;
+    int64_t now = av_gettime_relative();
+    int ret;
+
+    if (!ifile->reconnect_attempt) {
+        ifile->lost_time       = now;
+        ifile->lost_ts         = input_last_ts(ifile);
+        ifile->reconnect_delay = 0;
+        ifile->reconnect_time  = now;   /* the first attempt is immediate */
+#if HAVE_PTHREADS
+        free_input_thread(file_index);
+#endif
+    }
+    if (now < ifile->reconnect_time)
+        return AVERROR(EAGAIN);
+
+    ifile->reconnect_attempt++;
+    av_log(NULL, AV_LOG_WARNING, "Reconnecting input #%d (attempt %d)\n",
+           file_index, ifile->reconnect_attempt);
+    /* the format is known, no need to probe it again */
+    ret = open_input_context(ifile, 0, ifile->ctx, ifile->ctx->filename,
+                             ifile->ctx->iformat, &ic);
+    if (ret >= 0 && (ret = check_input_compatible(ifile, ic)) < 0)
+        avformat_close_input(&ic);
+    if (ret < 0) {
+        print_error(ifile->ctx->filename, ret);
+        if (input_reconnect > 0 && ifile->reconnect_attempt >= input_reconnect) {
+            ifile->reconnect_attempt = 0;
+            return ret;
+        }
+        /* the delay doubles with equal jitter */
+        ifile->reconnect_delay = FFMIN(FFMAX(ifile->reconnect_delay * 2, 100),
+                                       input_reconnect_delay_max);
+        ifile->reconnect_time  = av_gettime_relative() + 1000LL *
+            (ifile->reconnect_delay / 2 + av_get_random_seed() % (ifile->reconnect_delay / 2 + 1));
+        return AVERROR(EAGAIN);
+    }
+
+    ifile->reconnect_attempt = 0;
+    replace_input_context(ifile, ic);
+    return resume_input_file(file_index, ifile->lost_ts, ifile->lost_time);
+}
+
+#if HAVE_PTHREADS
+#define STANDBY_REFRESH_TIME 30     /* seconds, reopen the standby before the paused session expires */
+#define STANDBY_DRAIN_PERIOD 20     /* ms, drain the standby which cannot pause */
+#define STANDBY_DRAIN_TIMEOUT 1000  /* ms, the standby which cannot pause is lost if silent longer */
+#define STANDBY_DRAIN_MAX    64     /* packets discarded at most per drain */
+
+/*
+ * The interrupt state of the contexts opened for an alternate.
+ *
+ * The IO of a standby is neither aborted by the deadline of the input
+ * nor bounded by it. The protocols copy the interrupt callback when
+ * opened, so the state lives until the input is freed and is switched
+ * to the input when the standby is taken over.
+ */
+typedef struct StandbyIO {
+    InputFile *f;
+    volatile int active;        /* taken over as the input */
+    volatile int64_t deadline;  /* av_gettime_relative() to abort the standby IO, 0 if none */
+} StandbyIO;
+
+/*
+ * A warm standby of the input alternates.
+ *
+ * The standby thread keeps one of the alternates (the input url followed
+ * by -input_backup) other than the active one opened, probed and paused,
+ * and reopens it periodically. The one which cannot pause is drained
+ * instead, so that it holds no stale data. When the active one is lost,
+ * the main thread takes it over at once and the thread opens the next one.
+ */
+typedef struct InputStandby {
+    char **urls;            /* the input url and its alternates in order */
+    int nb_urls;
+    StandbyIO *io;          /* the interrupt state by url */
+    int active_url;         /* the url being read by the main thread */
+    int next_url;           /* the url to open as the standby */
+    AVFormatContext *tmpl;  /* the settings to open the alternates */
+    AVFormatContext *ctx;   /* the paused or drained standby, NULL if not ready */
+    int ctx_url;
+    int ctx_paused;         /* ctx is paused, otherwise drained */
+    int takeover;           /* the main thread waits for the mutex to take ctx over, accessed atomically */
+    int64_t ctx_time;       /* when ctx is opened */
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;    /* bound to CLOCK_MONOTONIC */
+} InputStandby;
+
+static int standby_interrupt_cb(void *arg)
+{
+    StandbyIO *io = arg;
+    int64_t deadline;
+
+    if (io->active)
+        return input_interrupt_cb(io->f);
+    if (received_nb_signals > transcode_init_done || io->f->standby_abort)
+        return 1;
+    deadline = io->deadline;
+    return deadline && av_gettime_relative() >= deadline;
+}
+
+/*
+ * discard what the standby which cannot pause has received,
+ * called with the mutex locked. the reads are non-blocking where the demuxer
+ * supports it, and bounded by STANDBY_DRAIN_TIMEOUT anyway. the drain stops
+ * at once a takeover is waiting, which holds the mutex for one read at most.
+ * return a negative AVERROR if the standby is lost
+ */
+static int drain_input_standby(InputStandby *sb)
+{
+    StandbyIO *io = &sb->io[sb->ctx_url];
+    AVPacket pkt;
+    int i, ret = 0;
+
+    io->deadline = av_gettime_relative() + STANDBY_DRAIN_TIMEOUT * 1000LL;
+    for (i = 0; i < STANDBY_DRAIN_MAX &&
+                !__atomic_load_n(&sb->takeover, __ATOMIC_ACQUIRE); i++) {
+        av_init_packet(&pkt);
+        ret = av_read_frame(sb->ctx, &pkt);
+        if (ret < 0)
+            break;
+        av_packet_unref(&pkt);
+        io->deadline = av_gettime_relative() + STANDBY_DRAIN_TIMEOUT * 1000LL;
+    }
+    io->deadline = 0;
+    return ret == AVERROR(EAGAIN) ? 0 : FFMIN(ret, 0);
+}
+
+static void *standby_thread(void *arg)
+{
+    InputFile *f = arg;
+    InputStandby *sb = f->standby;
+    int delay = 0;
+
+    pthread_mutex_lock(&sb->mutex);
+    while (!f->standby_abort) {
+        AVFormatContext *ic = NULL, *old = NULL;
+        int url, paused = 0, ret;
+
+        if (sb->ctx && !sb->ctx_paused && (ret = drain_input_standby(sb)) < 0) {
+            av_log(NULL, AV_LOG_WARNING, "Standby %s lost: %s\n",
+                   sb->urls[sb->ctx_url], av_err2str(ret));
+            old = sb->ctx;
+            sb->ctx = NULL;
+            pthread_mutex_unlock(&sb->mutex);
+            avformat_close_input(&old);
+            pthread_mutex_lock(&sb->mutex);
+            continue;
+        }
+        if (sb->ctx) {
+            struct timespec ts;
+            int64_t now = av_gettime_relative();
+            int64_t expire = sb->ctx_time + STANDBY_REFRESH_TIME * 1000000LL;
+            if (now < expire) {
+                if (!sb->ctx_paused)
+                    expire = FFMIN(expire, now + STANDBY_DRAIN_PERIOD * 1000LL);
+                clock_gettime(CLOCK_MONOTONIC, &ts); // cond is bound to CLOCK_MONOTONIC
+                ts.tv_sec  += (expire - now) / 1000000;
+                ts.tv_nsec += (expire - now) % 1000000 * 1000;
+                if (ts.tv_nsec >= 1000000000) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&sb->cond, &sb->mutex, &ts);
+                continue;
+            }
+        }
+        if (sb->next_url == sb->active_url)
+            sb->next_url = (sb->next_url + 1) % sb->nb_urls;
+        url = sb->next_url;
+        pthread_mutex_unlock(&sb->mutex);
+
+        while (delay > 0 && !f->standby_abort && !received_nb_signals) {
+            av_usleep(FFMIN(delay, 100) * 1000);
+            delay -= 100;
+        }
+        /* the IO timing of f belongs to the main thread, the standby has its own,
+         * bounding the open, the probe and the pause by twice -input_io_timeout */
+        sb->io[url].active   = 0;
+        sb->io[url].deadline = input_io_timeout > 0 ?
+                               av_gettime_relative() + 2 * input_io_timeout * 1000LL : 0;
+        sb->tmpl->interrupt_callback.opaque = &sb->io[url];
+        ret = open_input_context(f, 1, sb->tmpl, sb->urls[url], NULL, &ic);
+        if (ret >= 0)
+            paused = av_read_pause(ic) >= 0;  /* not supported by every demuxer */
+        sb->io[url].deadline = 0;
+
+        pthread_mutex_lock(&sb->mutex);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_WARNING, "Open standby %s failed: %s\n",
+                   sb->urls[url], av_err2str(ret));
+            if (sb->next_url == url)
+                sb->next_url = (url + 1) % sb->nb_urls;
+            delay = FFMIN(FFMAX(delay * 2, 100), input_reconnect_delay_max);
+            continue;
+        }
+        delay = 0;
+        if (f->standby_abort || url == sb->active_url) {
+            old = ic;   /* taken over by another one in the meanwhile */
+        } else {
+            old = sb->ctx;
+            sb->ctx = ic;
+            sb->ctx_url = url;
+            sb->ctx_time = av_gettime_relative();
+            sb->ctx_paused = paused;
+        }
+        pthread_mutex_unlock(&sb->mutex);
+        avformat_close_input(&old);
+        pthread_mutex_lock(&sb->mutex);
+    }
+    pthread_mutex_unlock(&sb->mutex);
+    return NULL;
+}
+
+static int init_input_standby(int file_index)
+{
+    InputFile *f = input_files[file_index];
+    InputStandby *sb;
+    char *urls, *url, *saveptr = NULL;
+    int i, ret;
+
+    sb = av_mallocz(sizeof(*sb));
+    if (!sb)
+        return AVERROR(ENOMEM);
+    f->standby = sb;
+    if ((ret = av_dynarray_add_nofree(&sb->urls, &sb->nb_urls, av_strdup(f->ctx->filename))) < 0)
+        return ret;
+    urls = av_strdup(f->backup_urls);
+    if (!urls)
+        return AVERROR(ENOMEM);
+    for (url = av_strtok(urls, "|", &saveptr); url; url = av_strtok(NULL, "|", &saveptr)) {
+        if ((ret = av_dynarray_add_nofree(&sb->urls, &sb->nb_urls, av_strdup(url))) < 0)
+            break;
+    }
+    av_free(urls);
+    if (ret < 0)
+        return ret;
+    if (sb->nb_urls < 2)
+        return 0;
+    sb->io = av_mallocz_array(sb->nb_urls, sizeof(*sb->io));
+    if (!sb->io)
+        return AVERROR(ENOMEM);
+    for (i = 0; i < sb->nb_urls; i++)
+        sb->io[i].f = f;
+
+    sb->tmpl = avformat_alloc_context();
+    if (!sb->tmpl)
+        return AVERROR(ENOMEM);
+    sb->tmpl->video_codec_id    = f->ctx->video_codec_id;
+    sb->tmpl->audio_codec_id    = f->ctx->audio_codec_id;
+    sb->tmpl->subtitle_codec_id = f->ctx->subtitle_codec_id;
+    sb->tmpl->data_codec_id     = f->ctx->data_codec_id;
+    av_format_set_video_codec   (sb->tmpl, av_format_get_video_codec(f->ctx));
+    av_format_set_audio_codec   (sb->tmpl, av_format_get_audio_codec(f->ctx));
+    av_format_set_subtitle_codec(sb->tmpl, av_format_get_subtitle_codec(f->ctx));
+    av_format_set_data_codec    (sb->tmpl, av_format_get_data_codec(f->ctx));
+    sb->tmpl->interrupt_callback.callback = standby_interrupt_cb;
+    sb->next_url = 1;
+
+    pthread_mutex_init(&sb->mutex, NULL);
+    {
+        //the timed wait of the standby should not be affected by the system time change
+        pthread_condattr_t cond_attr;
+        pthread_condattr_init(&cond_attr);
+        pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&sb->cond, &cond_attr);
+        pthread_condattr_destroy(&cond_attr);
+    }
+    if ((ret = pthread_create(&sb->thread, NULL, standby_thread, f))) {
+        av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s\n", strerror(ret));
+        pthread_mutex_destroy(&sb->mutex);
+        pthread_cond_destroy(&sb->cond);
+        avformat_free_context(sb->tmpl);
+        sb->tmpl = NULL;
+        return AVERROR(ret);
+    }
+    return 0;
+}
+
+static void free_input_standby(int file_index)
+{
+    InputFile *f = input_files[file_index];
+    InputStandby *sb = f->standby;
+    int i;
+
+    if (!sb)
+        return;
+    if (sb->tmpl) {
+        pthread_mutex_lock(&sb->mutex);
+        f->standby_abort = 1;
+        pthread_cond_signal(&sb->cond);
+        pthread_mutex_unlock(&sb->mutex);
+        pthread_join(sb->thread, NULL);
+        pthread_mutex_destroy(&sb->mutex);
+        pthread_cond_destroy(&sb->cond);
+        avformat_close_input(&sb->ctx);
+        avformat_free_context(sb->tmpl);
+    }
+    for (i = 0; i < sb->nb_urls; i++)
+        av_free(sb->urls[i]);
+    av_free(sb->urls);
+    av_free(sb->io);
+    av_freep(&f->standby);
+}
+
+/* switch the lost input to the warm standby */
+static int failover_input_file(int file_index)
+{
+    InputFile *ifile = input_files[file_index];
+    InputStandby *sb = ifile->standby;
+    AVFormatContext *ic;
+    int64_t lost_time = av_gettime_relative();
+    int64_t last_ts = input_last_ts(ifile);
+    int paused = 0, ret;
+
+    if (!sb || !sb->tmpl)
+        return AVERROR(ENOSYS);
+
+    /* stop the drain in progress, if any, so that the mutex is released soon */
+    __atomic_store_n(&sb->takeover, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&sb->mutex);
+    __atomic_store_n(&sb->takeover, 0, __ATOMIC_RELAXED);
+    ic = sb->ctx;
+    sb->ctx = NULL;
+    ret = ic ? check_input_compatible(ifile, ic) : AVERROR(EAGAIN);
+    if (ret >= 0) {
+        /* its IO is under the timing of the input from now on */
+        sb->io[sb->ctx_url].active = 1;
+        sb->active_url = sb->ctx_url;
+        paused = sb->ctx_paused;
+    }
+    if (ic)
+        sb->next_url = (sb->ctx_url + 1) % sb->nb_urls;
+    pthread_cond_signal(&sb->cond);  /* open the next standby */
+    pthread_mutex_unlock(&sb->mutex);
+
+    if (!ic) {
+        av_log(NULL, AV_LOG_WARNING, "No standby of input #%d is ready\n", file_index);
+        return ret;
+    }
+    if (ret < 0) {
+        /* the input stays as it is, the next alternate is opened instead */
+        avformat_close_input(&ic);
+        return ret;
+    }
+
+    free_input_thread(file_index);
+    if (paused)
+        av_read_play(ic);
+    replace_input_context(ifile, ic);
+    return resume_input_file(file_index, last_ts, lost_time);
+}
+#endif
+#endif
+
 /*
  * Return
  * - 0 -- one packet was read and processed
@@ -3735,6 +4497,11 @@ static int process_input(int file_index)
     int ret, i, j;
 
     is  = ifile->ctx;
+#ifdef FFMPEG_IVR
+    if (ifile->reconnect_attempt)
+        ret = AVERROR_EOF;  /* lost, go on reconnecting below */
+    else
+#endif
     ret = get_input_packet(ifile, &pkt);
 
     if (ret == AVERROR(EAGAIN)) {
@@ -3747,6 +4514,23 @@ static int process_input(int file_index)
             if (exit_on_error)
                 exit_program(1);
         }
+#ifdef FFMPEG_IVR
+#if HAVE_PTHREADS
+        if (ifile->standby && !ifile->reconnect_attempt && !received_nb_signals &&
+            failover_input_file(file_index) >= 0)
+            return 0;
+#endif
+        if (input_reconnect && !received_nb_signals && input_is_live(ifile)) {
+            ret = reconnect_input_file(file_index);
+            if (ret >= 0)
+                return 0;
+            if (ret == AVERROR(EAGAIN)) {
+                /* the other inputs are read until the next attempt */
+                ifile->eagain = 1;
+                return ret;
+            }
+        }
+#endif
 
         for (i = 0; i < ifile->nb_streams; i++) {
             ist = input_streams[ifile->ist_index + i];
@@ -3791,6 +4575,24 @@ static int process_input(int file_index)
     if (ist->discard)
         goto discard_packet;
 
+#ifdef FFMPEG_IVR
+    if (ist->wait_keyframe) {
+        if (!(pkt.flags & AV_PKT_FLAG_KEY))
+            goto discard_packet;
+        ist->wait_keyframe = 0;
+    }
+    if (ist->new_extradata && (pkt.flags & AV_PKT_FLAG_KEY)) {
+        /* the muxer starts a new segment for it, see cseg */
+        AVCodecContext *avctx = ist->st->codec;
+        uint8_t *dst_data = av_packet_new_side_data(&pkt, AV_PKT_DATA_NEW_EXTRADATA,
+                                                    avctx->extradata_size);
+        if (!dst_data)
+            exit_program(1);
+        memcpy(dst_data, avctx->extradata, avctx->extradata_size);
+        ist->new_extradata = 0;
+    }
+#endif
+
     if (debug_ts) {
         av_log(NULL, AV_LOG_INFO, "demuxer -> ist_index:%d type:%s "
                "next_dts:%s next_dts_time:%s next_pts:%s next_pts_time:%s pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s off:%s off_time:%s\n",
@@ -3859,6 +4661,16 @@ static int process_input(int file_index)
         }
     }
 
+#ifdef FFMPEG_IVR
+    /* continue the timestamps before the input is lost, keeping the outage as a gap */
+    if (ifile->reconnected && pkt.dts != AV_NOPTS_VALUE) {
+        ifile->ts_offset = ifile->reconnect_ts -
+                           av_rescale_q(pkt.dts, ist->st->time_base, AV_TIME_BASE_Q);
+        ifile->reconnected = 0;
+        av_log(NULL, AV_LOG_DEBUG, "Input #%d reconnected, new offset= %"PRId64"\n",
+               ist->file_index, ifile->ts_offset);
+    }
+#endif
     if (pkt.dts != AV_NOPTS_VALUE)
         pkt.dts += av_rescale_q(ifile->ts_offset, AV_TIME_BASE_Q, ist->st->time_base);
     if (pkt.pts != AV_NOPTS_VALUE)
@@ -4069,6 +4881,183 @@ static int transcode_step(void)
 /*
  * The following code is the main loop of the file converter
  */
+#ifdef FFMPEG_IVR
+static void print_latency_report(int is_last_report, int64_t cur_time)
+{
+    static int64_t last_time = -1;
+
+    if (!ivr_latency_enabled)
+        return;
+    if (!is_last_report) {
+        if (last_time == -1) {
+            last_time = cur_time;
+            return;
+        }
+        if (cur_time - last_time < (int64_t)latency_stats_interval * 1000000)
+            return;
+    }
+    last_time = cur_time;
+    ivr_latency_report(NULL, AV_LOG_INFO);
+}
+#endif
+
+#ifdef FFMPEG_IVR
+/* 
+ * catch the event signals only if any cseg output is triggered by events, 
+ * otherwise they keep the default disposition
+ */
+static void event_signal_init(void)
+{
+#ifdef SIGUSR1
+    int i;
+
+    for (i = 0; i < nb_output_files; i++) {
+        if (ffmpeg_ivr_cseg_event_enabled(output_files[i]->ctx)) {
+            signal(SIGUSR1, event_signal_handler);
+            signal(SIGUSR2, event_signal_handler);
+            return;
+        }
+    }
+#endif
+}
+
+/* forward the event signal to the cseg outputs */
+static void check_event_signal(void)
+{
+    int sig = received_event_signal;
+    int i;
+
+    if (!sig)
+        return;
+    received_event_signal = 0;
+    for (i = 0; i < nb_output_files; i++) {
+        if (ffmpeg_ivr_cseg_trigger(output_files[i]->ctx, sig == SIGUSR1) == 0)
+            av_log(NULL, AV_LOG_INFO, "Output #%d: event %s by signal %d\n",
+                   i, sig == SIGUSR1 ? "started" : "stopped", sig);
+    }
+}
+#endif
+
+#ifdef FFMPEG_IVR
+/*
+ * periodically dump the statistics as a JSON object to stats_file,
+ * which is replaced atomically by rename() so that a poller never 
+ * sees a partial file
+ */
+static void print_stats_file(int is_last_report, int64_t timer_start, int64_t cur_time)
+{
+    static int64_t last_time = -1;
+    static uint64_t last_frames = 0, last_bytes = 0;
+    static IvrLatencySnapshot last_latency, cur_latency;
+    AVBPrint buf;
+    char *tmp_file;
+    FILE *fp;
+    uint64_t frames = 0, bytes = 0;
+    double period, uptime;
+    int i, vid = 0, nb_outputs = 0;
+
+    if (!stats_file)
+        return;
+    if (!is_last_report) {
+        if (last_time == -1) {
+            last_time = cur_time;
+            return;
+        }
+        if (cur_time - last_time < (int64_t)FFMAX(stats_period, 1) * 1000000)
+            return;
+    }
+    period = last_time == -1 ? 0 : (cur_time - last_time) / 1000000.0;
+    uptime = (cur_time - timer_start) / 1000000.0;
+    last_time = cur_time;
+
+    for (i = 0; i < nb_output_streams; i++) {
+        OutputStream *ost = output_streams[i];
+        bytes += ost->data_size;
+        if (!vid && ost->st->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+            frames = ost->frame_number;
+            vid = 1;
+        }
+    }
+
+    av_bprint_init(&buf, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&buf, "{\n");
+    av_bprintf(&buf, "  \"time\": %.3f,\n", av_gettime() / 1000000.0);
+    av_bprintf(&buf, "  \"uptime\": %.3f,\n", uptime);
+    av_bprintf(&buf, "  \"frames\": %"PRIu64",\n", frames);
+    av_bprintf(&buf, "  \"fps\": %.2f,\n", 
+               period > 0 ? (frames - last_frames) / period : 0.0);
+    av_bprintf(&buf, "  \"bytes_muxed\": %"PRIu64",\n", bytes);
+    av_bprintf(&buf, "  \"bitrate_kbps\": %.1f,\n", 
+               period > 0 ? (bytes - last_bytes) * 8 / period / 1000.0 : 0.0);
+    av_bprintf(&buf, "  \"maxrss_kb\": %"PRId64",\n", getmaxrss() / 1024);
+    av_bprintf(&buf, "  \"utime_ms\": %"PRId64",\n", getutime() / 1000);
+    last_frames = frames;
+    last_bytes = bytes;
+
+    av_bprintf(&buf, "  \"outputs\": [");
+    for (i = 0; i < nb_output_files; i++) {
+        CachedSegmentStats cs;
+        if (ffmpeg_ivr_cseg_stats(output_files[i]->ctx, &cs) < 0)
+            continue;
+        av_bprintf(&buf, "%s\n    {\"index\": %d, ", nb_outputs++ ? "," : "", i);
+        av_bprintf(&buf, "\"cached_segments\": %u, \"free_segments\": %u, \"max_segments\": %u, ",
+                   cs.cached_segments, cs.free_segments, cs.max_segments);
+        av_bprintf(&buf, "\"segments_written\": %"PRId64", \"segments_dropped\": %"PRId64", "
+                   "\"segments_degraded\": %"PRId64", \"bytes_written\": %"PRId64", ",
+                   cs.segments_written, cs.segments_dropped, cs.segments_degraded, cs.bytes_written);
+        av_bprintf(&buf, "\"write_time_avg_ms\": %.3f, \"write_time_max_ms\": %.3f, ",
+                   cs.segments_written ? cs.write_time_total / 1000.0 / cs.segments_written : 0.0,
+                   cs.write_time_max / 1000.0);
+        av_bprintf(&buf, "\"http\": {\"2xx\": %"PRId64", \"3xx\": %"PRId64", \"4xx\": %"PRId64", "
+                   "\"5xx\": %"PRId64", \"errors\": %"PRId64"}}",
+                   cs.http_2xx, cs.http_3xx, cs.http_4xx, cs.http_5xx, cs.http_errors);
+    }
+    av_bprintf(&buf, "%s]", nb_outputs ? "\n  " : "");
+
+    if (ivr_latency_enabled) {
+        int stage;
+        ivr_latency_snapshot(&cur_latency);
+        av_bprintf(&buf, ",\n  \"latency\": {");
+        for (stage = 0; stage < IVR_LATENCY_NB; stage++) {
+            IvrLatencySummary sum;
+            ivr_latency_summary(&cur_latency, &last_latency, stage, &sum);
+            av_bprintf(&buf, "%s\n    \"%s\": {\"count\": %"PRIu64", \"p50_ms\": %.3f, "
+                       "\"p90_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, \"max_ms\": %.3f}",
+                       stage ? "," : "", ivr_latency_stage_name(stage), sum.count, 
+                       sum.p50 / 1000.0, sum.p90 / 1000.0, sum.p99 / 1000.0, 
+                       sum.p999 / 1000.0, sum.max / 1000.0);
+        }
+        av_bprintf(&buf, "\n  }");
+        memcpy(&last_latency, &cur_latency, sizeof(IvrLatencySnapshot));
+    }
+    av_bprintf(&buf, "\n}\n");
+
+    tmp_file = av_asprintf("%s.tmp", stats_file);
+    if (!tmp_file || !av_bprint_is_complete(&buf)) {
+        av_log(NULL, AV_LOG_WARNING, "Failed to build the stats\n");
+        goto end;
+    }
+    fp = fopen(tmp_file, "w");
+    if (!fp) {
+        av_log(NULL, AV_LOG_WARNING, "Failed to open stats file %s: %s\n", 
+               tmp_file, strerror(errno));
+        goto end;
+    }
+    if (fwrite(buf.str, 1, buf.len, fp) != buf.len) {
+        av_log(NULL, AV_LOG_WARNING, "Failed to write stats file %s\n", tmp_file);
+        fclose(fp);
+        goto end;
+    }
+    fclose(fp);
+    if (rename(tmp_file, stats_file) < 0)
+        av_log(NULL, AV_LOG_WARNING, "Failed to rename stats file to %s: %s\n", 
+               stats_file, strerror(errno));
+end:
+    av_free(tmp_file);
+    av_bprint_finalize(&buf, NULL);
+}
+#endif
+
 static int transcode(void)
 {
     int ret, i;
@@ -4080,6 +5069,10 @@ static int transcode(void)
     ret = transcode_init();
     if (ret < 0)
         goto fail;
+#ifdef FFMPEG_IVR
+    /* the cseg options are known once the headers are written */
+    event_signal_init();
+#endif
 
     if (stdin_interaction) {
         av_log(NULL, AV_LOG_INFO, "Press [q] to stop, [?] for help\n");
@@ -4090,6 +5083,12 @@ static int transcode(void)
 #if HAVE_PTHREADS
     if ((ret = init_input_threads()) < 0)
         goto fail;
+#ifdef FFMPEG_IVR
+    for (i = 0; i < nb_input_files; i++) {
+        if (input_files[i]->backup_urls && (ret = init_input_standby(i)) < 0)
+            goto fail;
+    }
+#endif
 #endif
 
     while (!received_sigterm) {
@@ -4121,10 +5120,19 @@ static int transcode(void)
 
         /* dump report by using the output first video and audio streams */
         print_report(0, timer_start, cur_time);
+#ifdef FFMPEG_IVR
+        check_event_signal();
+        print_latency_report(0, cur_time);
+        print_stats_file(0, timer_start, cur_time);
+#endif
     }
 #if HAVE_PTHREADS
     free_input_threads();
 #endif
+#ifdef FFMPEG_IVR
+    print_latency_report(1, av_gettime_relative());
+    print_stats_file(1, timer_start, av_gettime_relative());
+#endif
 
     /* at the end of stream, we must flush the decoder buffers */
     for (i = 0; i < nb_input_streams; i++) {
@@ -121,6 +121,9 @@ typedef struct OptionsContext {
     int rate_emu;
     int accurate_seek;
     int thread_queue_size;
+#ifdef FFMPEG_IVR
+    char *input_backup;
+#endif
 
     SpecifierOpt *ts_scale;
     int        nb_ts_scale;
@@ -342,6 +345,11 @@ typedef struct InputStream {
     // number of frames/samples retrieved from the decoder
     uint64_t frames_decoded;
     uint64_t samples_decoded;
+
+#ifdef FFMPEG_IVR
+    int wait_keyframe;      /* drop the packets until a key frame after the input is reconnected */
+    int new_extradata;      /* send the extradata of the reconnected input with the next key frame */
+#endif
 } InputStream;
 
 typedef struct InputFile {
@@ -371,7 +379,21 @@ typedef struct InputFile {
 
 
 #ifdef FFMPEG_IVR
-    struct timespec io_start_ts;    
+    unsigned io_gen;            /* bumped on each IO start and stop, odd while in progress, accessed atomically */
+    unsigned io_expired;        /* the io_gen found expired by the IO watchdog, accessed atomically */
+    int64_t io_start_us;        /* when the IO is started, only kept for latency stats */
+    int64_t io_done_us;         /* when the last packet is read, for latency stats */
+    AVDictionary *format_opts;  /* demuxer options, kept to reopen the input */
+    int reconnected;            /* the timestamps are rebased on the next packet */
+    int64_t reconnect_ts;       /* where the timestamps continue after reconnected, in AV_TIME_BASE */
+    int reconnect_attempt;      /* attempts made to reconnect the lost input, 0 if not lost */
+    int reconnect_delay;        /* backoff delay before the next attempt, in ms */
+    int64_t reconnect_time;     /* av_gettime_relative() of the next attempt */
+    int64_t lost_time;          /* av_gettime_relative() when the input is lost */
+    int64_t lost_ts;            /* where the timestamps of the lost input stop, in AV_TIME_BASE */
+    char *backup_urls;          /* the alternates of the input separated by '|' */
+    struct InputStandby *standby;   /* the warm standby of the alternates */
+    volatile int standby_abort; /* stop the standby thread */
 #endif
 
 } InputFile;
@@ -491,6 +513,9 @@ typedef struct OutputFile {
     uint64_t limit_filesize; /* filesize limit expressed in bytes */
 
     int shortest;
+#ifdef FFMPEG_IVR
+    int remux_fast_path;     /* plain stream copy into cseg, bypass the interleaving queue */
+#endif
 } OutputFile;
 
 extern InputStream **input_streams;
@@ -545,12 +570,22 @@ extern const HWAccel hwaccels[];
 
 #ifdef FFMPEG_IVR
 extern int input_io_timeout;
+extern int input_reconnect;
+extern int input_reconnect_delay_max;
+extern char *probe_cache_dir;
 extern int64_t output_io_bw;
+extern int latency_stats_interval;
+extern char *stats_file;
+extern int stats_period;
 extern int64_t cur_sec;
 extern int64_t cur_bytes;
 int input_interrupt_cb(void *arg);
 void input_start_io(InputFile *f);
 void input_stop_io(InputFile *f);
+#if HAVE_PTHREADS
+int input_watchdog_add(InputFile *f);
+void input_watchdog_stop(void);
+#endif
 #endif
 
 
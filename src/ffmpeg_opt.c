@@ -47,6 +47,9 @@
 #include "libavutil/pixfmt.h"
 #ifndef FFMPEG_IVR
 #include "libavutil/time_internal.h"
+#else
+#include "ivr_latency.h"
+#include "ivr_probe_cache.h"
 #endif
 
 #define DEFAULT_PASS_LOGFILENAME_PREFIX "ffmpeg2pass"
@@ -119,7 +122,13 @@ float max_error_rate  = 2.0/3;
 
 #ifdef FFMPEG_IVR
 int input_io_timeout = 0;   //default is 0, disable input io timeout check
+int input_reconnect = 0;    //default is 0, disable input reconnect, -1 for no limit
+int input_reconnect_delay_max = 5000;   //the max delay between reconnect attempts, unit is millisecond
+char *probe_cache_dir = NULL;   //default is NULL, disable the stream probe cache
 int64_t output_io_bw = 0;    //default is 0, disable IO bandwhich contrial, unit is Bytes/s
+int latency_stats_interval = 0;  //default is 0, disable latency statistics, unit is second
+char *stats_file = NULL;     //default is NULL, disable the stats file
+int stats_period = 10;       //the period to update stats file, unit is second
 int64_t cur_sec = 0;
 int64_t cur_bytes = 0;
 #endif
@@ -856,6 +865,9 @@ static int open_input_file(OptionsContext *o, const char *filename)
     char *subtitle_codec_name = NULL;
     char *    data_codec_name = NULL;
     int scan_all_pmts_set = 0;
+#ifdef FFMPEG_IVR
+    int cached = 0;
+#endif
 
     if (o->format) {
         if (!(file_iformat = av_find_input_format(o->format))) {
@@ -880,6 +892,10 @@ static int open_input_file(OptionsContext *o, const char *filename)
     f = av_mallocz(sizeof(*f));
     if (!f)
         exit_program(1);  
+#if HAVE_PTHREADS
+    if (input_io_timeout > 0 && input_watchdog_add(f) < 0)
+        exit_program(1);
+#endif
 #endif    
     if (o->nb_audio_sample_rate) {
         av_dict_set_int(&o->g->format_opts, "sample_rate", o->audio_sample_rate[o->nb_audio_sample_rate - 1].u.i, 0);
@@ -947,6 +963,7 @@ static int open_input_file(OptionsContext *o, const char *filename)
     }
     /* open the input file with generic avformat function */
 #ifdef FFMPEG_IVR  
+    av_dict_copy(&f->format_opts, o->g->format_opts, 0);
     input_start_io(f);
     err = avformat_open_input(&ic, filename, file_iformat, &o->g->format_opts);
     input_stop_io(f);
@@ -973,9 +990,32 @@ static int open_input_file(OptionsContext *o, const char *filename)
     /* If not enough info to get the stream parameters, we decode the
        first frames to get it. (used in mpeg case for example) */
 #ifdef FFMPEG_IVR    
-    input_start_io(f);
-    ret = avformat_find_stream_info(ic, opts);
-    input_stop_io(f);
+    if (probe_cache_dir && orig_nb_streams > 0)
+        cached = probe_cache_load(probe_cache_dir, ic);
+    if (cached > 0) {
+        /* the cached parameters are only validated on the first packets */
+        int64_t probesize = ic->probesize;
+        int fps_probe_size = ic->fps_probe_size;
+        ic->probesize = 32;
+        ic->fps_probe_size = 0;
+        input_start_io(f);
+        ret = avformat_find_stream_info(ic, opts);
+        input_stop_io(f);
+        ic->probesize = probesize;
+        ic->fps_probe_size = fps_probe_size;
+    } else {
+        input_start_io(f);
+        ret = avformat_find_stream_info(ic, opts);
+        input_stop_io(f);
+    }
+    if (probe_cache_dir && orig_nb_streams > 0) {
+        if (ret < 0 || ic->nb_streams != orig_nb_streams) {
+            probe_cache_remove(probe_cache_dir, filename);
+        } else if (probe_cache_save(probe_cache_dir, ic) > 0 && cached > 0) {
+            av_log(NULL, AV_LOG_WARNING, "%s: stream parameters differ from the probe cache, updated\n",
+                   filename);
+        }
+    }
 #else
     ret = avformat_find_stream_info(ic, opts);
 #endif
@@ -1043,6 +1083,10 @@ static int open_input_file(OptionsContext *o, const char *filename)
     f->nb_streams = ic->nb_streams;
     f->rate_emu   = o->rate_emu;
     f->accurate_seek = o->accurate_seek;
+#ifdef FFMPEG_IVR
+    if (o->input_backup && !(f->backup_urls = av_strdup(o->input_backup)))
+        exit_program(1);
+#endif
 #if HAVE_PTHREADS
     f->thread_queue_size = o->thread_queue_size > 0 ? o->thread_queue_size : 8;
 #endif
@@ -3035,6 +3079,16 @@ static int opt_progress(void *optctx, const char *opt, const char *arg)
     return 0;
 }
 
+#ifdef FFMPEG_IVR
+static int opt_latency_stats(void *optctx, const char *opt, const char *arg)
+{
+    latency_stats_interval = parse_number_or_die(opt, arg, OPT_INT, 0, INT_MAX);
+    /* enable before any file is opened, so that the first segment is covered */
+    ivr_latency_enable(latency_stats_interval > 0);
+    return 0;
+}
+#endif
+
 #define OFFSET(x) offsetof(OptionsContext, x)
 const OptionDef options[] = {
     /* main options */
@@ -3046,8 +3100,20 @@ const OptionDef options[] = {
 #ifdef FFMPEG_IVR        
     { "input_io_timeout",         HAS_ARG | OPT_INT | OPT_EXPERT,              { &input_io_timeout },
         "the max io time (in milliseconds) for read a packet from input file, default is 0 means disabled", "msec" },   
+    { "probe_cache_dir",         HAS_ARG | OPT_STRING | OPT_EXPERT,              { &probe_cache_dir },
+        "cache the probed stream parameters of the inputs in the directory to speed up the next start", "dir" },   
+    { "input_reconnect",         HAS_ARG | OPT_INT | OPT_EXPERT,              { &input_reconnect },
+        "the max attempts to reopen a live input after it's lost, -1 for no limit, default is 0 means disabled", "number" },   
+    { "input_reconnect_delay_max",         HAS_ARG | OPT_INT | OPT_EXPERT,              { &input_reconnect_delay_max },
+        "the max delay (in milliseconds) between the input reconnect attempts, default is 5000", "msec" },   
     { "output_io_bw",         HAS_ARG | OPT_INT | OPT_EXPERT,              { &output_io_bw },
         "the max io bandwidth (in Bytes/sec) for writing to the output file, default is 0 means disabled", "Bytes/sec" },  
+    { "latency_stats",         HAS_ARG | OPT_EXPERT,              { .func_arg = opt_latency_stats },
+        "log the per-stage latency percentiles every given seconds, default is 0 means disabled", "seconds" },  
+    { "stats_file",         HAS_ARG | OPT_STRING | OPT_EXPERT,              { &stats_file },
+        "periodically write the runtime statistics in JSON to the given file", "filename" },  
+    { "stats_period",         HAS_ARG | OPT_INT | OPT_EXPERT,              { &stats_period },
+        "the period (in seconds) to update the stats file, default is 10", "seconds" },  
 #endif     
 
     { "y",              OPT_BOOL,                                    {              &file_overwrite },
@@ -3212,6 +3278,11 @@ const OptionDef options[] = {
     { "thread_queue_size", HAS_ARG | OPT_INT | OPT_OFFSET | OPT_EXPERT | OPT_INPUT,
                                                                      { .off = OFFSET(thread_queue_size) },
         "set the maximum number of queued packets from the demuxer" },
+#ifdef FFMPEG_IVR
+    { "input_backup",   HAS_ARG | OPT_STRING | OPT_OFFSET | OPT_EXPERT | OPT_INPUT,
+                                                                     { .off = OFFSET(input_backup) },
+        "set the alternate urls of the input separated by '|', one of them is kept as a warm standby", "urls" },
+#endif
 
     /* video options */
     { "vframes",      OPT_VIDEO | HAS_ARG  | OPT_PERFILE | OPT_OUTPUT,           { .func_arg = opt_video_frames },
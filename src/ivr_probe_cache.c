@@ -0,0 +1,419 @@
+/**
+ * This file is part of ffmpeg_ivr
+ * 
+ * Copyright (C) 2016  OpenSight (www.opensight.cn)
+ * 
+ * ffmpeg_ivr is an extension of ffmpeg to implements the new feature for IVR
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**/
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "ivr_probe_cache.h"
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "libavutil/avutil.h"
+#include "libavutil/mem.h"
+
+#define PROBE_CACHE_MAGIC       0x43425250      // "PRBC"
+#define PROBE_CACHE_VERSION     2
+#define PROBE_CACHE_EXT         ".probe"
+#define PROBE_CACHE_MAX_SIZE    (4 * 1024 * 1024)
+#define PROBE_CACHE_PATH_SIZE   2048
+
+/* the header of a cache file, followed by the streams.
+ * only the hash of the url is kept, which may carry the credentials */
+typedef struct ProbeCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t url_hash;
+    int32_t nb_streams;
+    int32_t reserved;
+} ProbeCacheHeader;
+
+/* the parameters of a stream, followed by its extradata */
+typedef struct ProbeCacheStream {
+    int32_t codec_type;
+    int32_t codec_id;
+    int32_t time_base_num;
+    int32_t time_base_den;
+    int32_t width;
+    int32_t height;
+    int32_t pix_fmt;
+    int32_t sample_rate;
+    int32_t channels;
+    int32_t sample_fmt;
+    uint64_t channel_layout;
+    int32_t sar_num;
+    int32_t sar_den;
+    int32_t avg_frame_rate_num;
+    int32_t avg_frame_rate_den;
+    int32_t r_frame_rate_num;
+    int32_t r_frame_rate_den;
+    int32_t codec_time_base_num;
+    int32_t codec_time_base_den;
+    int32_t ticks_per_frame;
+    int32_t has_b_frames;
+    int32_t profile;
+    int32_t level;
+    int32_t frame_size;
+    int32_t block_align;
+    int32_t extradata_size;
+    int32_t reserved;
+} ProbeCacheStream;
+
+/* FNV-1a */
+static uint64_t url_hash(const char *url)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const unsigned char *p;
+    
+    for (p = (const unsigned char *)url; *p; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* the cache file is named by the hash of the url */
+static void cache_path(const char *dir, const char *url, char *path, int path_size)
+{
+    snprintf(path, path_size, "%s/%016"PRIx64 PROBE_CACHE_EXT, dir, url_hash(url));
+}
+
+static int serialize(AVFormatContext *ic, uint8_t **buf, int *buf_size)
+{
+    ProbeCacheHeader header;
+    int size = sizeof(header);
+    uint8_t *p;
+    int i;
+    
+    for (i = 0; i < ic->nb_streams; i++) {
+        size += sizeof(ProbeCacheStream) + ic->streams[i]->codec->extradata_size;
+    }
+    if (size > PROBE_CACHE_MAX_SIZE)
+        return AVERROR(E2BIG);
+    p = *buf = av_malloc(size);
+    if (!p)
+        return AVERROR(ENOMEM);
+    *buf_size = size;
+    
+    memset(&header, 0, sizeof(header));
+    header.magic = PROBE_CACHE_MAGIC;
+    header.version = PROBE_CACHE_VERSION;
+    header.url_hash = url_hash(ic->filename);
+    header.nb_streams = ic->nb_streams;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    
+    for (i = 0; i < ic->nb_streams; i++) {
+        AVStream *st = ic->streams[i];
+        AVCodecContext *codec = st->codec;
+        ProbeCacheStream cs;
+        
+        memset(&cs, 0, sizeof(cs));
+        cs.codec_type = codec->codec_type;
+        cs.codec_id = codec->codec_id;
+        cs.time_base_num = st->time_base.num;
+        cs.time_base_den = st->time_base.den;
+        cs.width = codec->width;
+        cs.height = codec->height;
+        cs.pix_fmt = codec->pix_fmt;
+        cs.sample_rate = codec->sample_rate;
+        cs.channels = codec->channels;
+        cs.sample_fmt = codec->sample_fmt;
+        cs.channel_layout = codec->channel_layout;
+        cs.sar_num = st->sample_aspect_ratio.num;
+        cs.sar_den = st->sample_aspect_ratio.den;
+        cs.avg_frame_rate_num = st->avg_frame_rate.num;
+        cs.avg_frame_rate_den = st->avg_frame_rate.den;
+        cs.r_frame_rate_num = st->r_frame_rate.num;
+        cs.r_frame_rate_den = st->r_frame_rate.den;
+        cs.codec_time_base_num = codec->time_base.num;
+        cs.codec_time_base_den = codec->time_base.den;
+        cs.ticks_per_frame = codec->ticks_per_frame;
+        cs.has_b_frames = codec->has_b_frames;
+        cs.profile = codec->profile;
+        cs.level = codec->level;
+        cs.frame_size = codec->frame_size;
+        cs.block_align = codec->block_align;
+        cs.extradata_size = codec->extradata_size;
+        memcpy(p, &cs, sizeof(cs));
+        p += sizeof(cs);
+        if (codec->extradata_size > 0) {
+            memcpy(p, codec->extradata, codec->extradata_size);
+            p += codec->extradata_size;
+        }
+    }
+    return 0;
+}
+
+/* return 1 if the file is read into buf, 0 if it does not exist */
+static int read_cache_file(const char *path, uint8_t **buf, int *buf_size)
+{
+    FILE *fp;
+    long size;
+    int ret = 1;
+    
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+        return errno == ENOENT ? 0 : AVERROR(errno);
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 ||
+        fseek(fp, 0, SEEK_SET) != 0) {
+        ret = AVERROR(errno);
+    } else if (size > PROBE_CACHE_MAX_SIZE) {
+        ret = AVERROR_INVALIDDATA;
+    } else if ((*buf = av_malloc(size + 1)) == NULL) {
+        ret = AVERROR(ENOMEM);
+    } else if (size > 0 && fread(*buf, size, 1, fp) != 1) {
+        av_freep(buf);
+        ret = AVERROR(EIO);
+    } else {
+        *buf_size = size;
+    }
+    fclose(fp);
+    return ret;
+}
+
+/* check the header and return the first stream, or NULL if broken */
+static const uint8_t *parse_header(const uint8_t *buf, int size,
+                                   const char *url, ProbeCacheHeader *header)
+{
+    if (size < sizeof(*header))
+        return NULL;
+    memcpy(header, buf, sizeof(*header));
+    if (header->magic != PROBE_CACHE_MAGIC || header->version != PROBE_CACHE_VERSION ||
+        header->url_hash != url_hash(url) || header->nb_streams < 0)
+        return NULL;
+    return buf + sizeof(*header);
+}
+
+/* read the stream at *p and advance it, return 0 on success, -1 if broken */
+static int parse_stream(const uint8_t **p, const uint8_t *end,
+                        ProbeCacheStream *cs, const uint8_t **extradata)
+{
+    if (end - *p < sizeof(*cs))
+        return -1;
+    memcpy(cs, *p, sizeof(*cs));
+    *p += sizeof(*cs);
+    if (cs->extradata_size < 0 || end - *p < cs->extradata_size)
+        return -1;
+    *extradata = *p;
+    *p += cs->extradata_size;
+    return 0;
+}
+
+/* the cache must agree with everything the demuxer already knows */
+static int stream_matches(AVStream *st, const ProbeCacheStream *cs, const uint8_t *extradata)
+{
+    AVCodecContext *codec = st->codec;
+    
+    if (codec->codec_type != AVMEDIA_TYPE_UNKNOWN && codec->codec_type != cs->codec_type)
+        return 0;
+    if (codec->codec_id != AV_CODEC_ID_NONE && codec->codec_id != cs->codec_id)
+        return 0;
+    if (st->time_base.num != cs->time_base_num || st->time_base.den != cs->time_base_den)
+        return 0;
+    if ((codec->width && codec->width != cs->width) ||
+        (codec->height && codec->height != cs->height))
+        return 0;
+    if ((codec->sample_rate && codec->sample_rate != cs->sample_rate) ||
+        (codec->channels && codec->channels != cs->channels))
+        return 0;
+    if ((codec->has_b_frames && codec->has_b_frames != cs->has_b_frames) ||
+        (codec->profile != FF_PROFILE_UNKNOWN && codec->profile != cs->profile) ||
+        (codec->level != FF_LEVEL_UNKNOWN && codec->level != cs->level))
+        return 0;
+    if ((codec->frame_size && codec->frame_size != cs->frame_size) ||
+        (codec->block_align && codec->block_align != cs->block_align))
+        return 0;
+    if (codec->extradata_size &&
+        (codec->extradata_size != cs->extradata_size ||
+         memcmp(codec->extradata, extradata, cs->extradata_size) != 0))
+        return 0;
+    return 1;
+}
+
+static int populate_stream(AVStream *st, const ProbeCacheStream *cs, const uint8_t *extradata)
+{
+    AVCodecContext *codec = st->codec;
+    
+    codec->codec_type = cs->codec_type;
+    codec->codec_id = cs->codec_id;
+    if (!codec->width)
+        codec->width = cs->width;
+    if (!codec->height)
+        codec->height = cs->height;
+    if (codec->pix_fmt == AV_PIX_FMT_NONE)
+        codec->pix_fmt = cs->pix_fmt;
+    if (!codec->sample_rate)
+        codec->sample_rate = cs->sample_rate;
+    if (!codec->channels)
+        codec->channels = cs->channels;
+    if (codec->sample_fmt == AV_SAMPLE_FMT_NONE)
+        codec->sample_fmt = cs->sample_fmt;
+    if (!codec->channel_layout)
+        codec->channel_layout = cs->channel_layout;
+    if (!st->sample_aspect_ratio.num) {
+        st->sample_aspect_ratio.num = cs->sar_num;
+        st->sample_aspect_ratio.den = cs->sar_den;
+        codec->sample_aspect_ratio = st->sample_aspect_ratio;
+    }
+    if (!st->avg_frame_rate.num) {
+        st->avg_frame_rate.num = cs->avg_frame_rate_num;
+        st->avg_frame_rate.den = cs->avg_frame_rate_den;
+    }
+    if (!st->r_frame_rate.num) {
+        st->r_frame_rate.num = cs->r_frame_rate_num;
+        st->r_frame_rate.den = cs->r_frame_rate_den;
+    }
+    if (!codec->time_base.num) {
+        codec->time_base.num = cs->codec_time_base_num;
+        codec->time_base.den = cs->codec_time_base_den;
+        codec->ticks_per_frame = cs->ticks_per_frame;
+    }
+    if (!codec->has_b_frames)
+        codec->has_b_frames = cs->has_b_frames;
+    if (codec->profile == FF_PROFILE_UNKNOWN)
+        codec->profile = cs->profile;
+    if (codec->level == FF_LEVEL_UNKNOWN)
+        codec->level = cs->level;
+    if (!codec->frame_size)
+        codec->frame_size = cs->frame_size;
+    if (!codec->block_align)
+        codec->block_align = cs->block_align;
+    if (!codec->extradata_size && cs->extradata_size > 0) {
+        codec->extradata = av_mallocz(cs->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!codec->extradata)
+            return AVERROR(ENOMEM);
+        memcpy(codec->extradata, extradata, cs->extradata_size);
+        codec->extradata_size = cs->extradata_size;
+    }
+    return 0;
+}
+
+int probe_cache_load(const char *dir, AVFormatContext *ic)
+{
+    char path[PROBE_CACHE_PATH_SIZE];
+    ProbeCacheHeader header;
+    ProbeCacheStream cs;
+    const uint8_t *p, *end, *first, *extradata;
+    uint8_t *buf = NULL;
+    int size = 0;
+    int i, ret;
+    
+    //the demuxer creating streams while reading is not supported
+    if (ic->nb_streams == 0)
+        return 0;
+    
+    cache_path(dir, ic->filename, path, sizeof(path));
+    ret = read_cache_file(path, &buf, &size);
+    if (ret <= 0) {
+        if (ret < 0)
+            av_log(NULL, AV_LOG_WARNING, "[probe_cache] cannot read %s:%s\n", 
+                   path, av_err2str(ret));
+        return 0;
+    }
+    
+    end = buf + size;
+    first = parse_header(buf, size, ic->filename, &header);
+    if (first == NULL || header.nb_streams != ic->nb_streams)
+        goto mismatch;
+    
+    //validate all the streams before any is populated
+    for (i = 0, p = first; i < ic->nb_streams; i++) {
+        if (parse_stream(&p, end, &cs, &extradata) < 0 ||
+            !stream_matches(ic->streams[i], &cs, extradata))
+            goto mismatch;
+    }
+    for (i = 0, p = first; i < ic->nb_streams; i++) {
+        parse_stream(&p, end, &cs, &extradata);
+        if ((ret = populate_stream(ic->streams[i], &cs, extradata)) < 0) {
+            av_free(buf);
+            return ret;
+        }
+    }
+    av_free(buf);
+    return 1;
+    
+mismatch:
+    av_free(buf);
+    //the path is named by the url hash, the url itself may carry the credentials
+    av_log(NULL, AV_LOG_WARNING, "[probe_cache] %s mismatches the input, removed\n", 
+           path);
+    probe_cache_remove(dir, ic->filename);
+    return AVERROR_INVALIDDATA;
+}
+
+int probe_cache_save(const char *dir, AVFormatContext *ic)
+{
+    char path[PROBE_CACHE_PATH_SIZE];
+    char tmp_path[PROBE_CACHE_PATH_SIZE + 4];
+    uint8_t *buf = NULL, *old_buf = NULL;
+    int size = 0, old_size = 0;
+    FILE *fp;
+    int ret;
+    
+    if ((ret = serialize(ic, &buf, &size)) < 0)
+        return ret;
+    
+    cache_path(dir, ic->filename, path, sizeof(path));
+    if (read_cache_file(path, &old_buf, &old_size) > 0 && 
+        old_size == size && memcmp(old_buf, buf, size) == 0) {
+        ret = 0;    //not changed
+        goto out;
+    }
+    
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "[probe_cache] cannot create %s:%s\n", 
+               tmp_path, av_err2str(ret));
+        goto out;
+    }
+    ret = 1;
+    if (fwrite(buf, size, 1, fp) != 1)
+        ret = AVERROR(errno ? errno : EIO);
+    if (fclose(fp) != 0 && ret > 0)
+        ret = AVERROR(errno);
+    if (ret > 0 && rename(tmp_path, path) != 0)
+        ret = AVERROR(errno);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "[probe_cache] cannot save %s:%s\n", 
+               path, av_err2str(ret));
+        unlink(tmp_path);
+    }
+    
+out:
+    av_free(old_buf);
+    av_free(buf);
+    return ret;
+}
+
+void probe_cache_remove(const char *dir, const char *url)
+{
+    char path[PROBE_CACHE_PATH_SIZE];
+    
+    cache_path(dir, url, path, sizeof(path));
+    if (unlink(path) != 0 && errno != ENOENT) {
+        av_log(NULL, AV_LOG_WARNING, "[probe_cache] cannot remove %s\n", path);
+    }
+}
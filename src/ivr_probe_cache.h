@@ -0,0 +1,53 @@
+/**
+ * This file is part of ffmpeg_ivr
+ * 
+ * Copyright (C) 2016  OpenSight (www.opensight.cn)
+ * 
+ * ffmpeg_ivr is an extension of ffmpeg to implements the new feature for IVR
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**/
+
+#ifndef IVR_PROBE_CACHE_H
+#define IVR_PROBE_CACHE_H
+
+#include "libavformat/avformat.h"
+
+/*
+ * A persistent cache of the stream parameters of the inputs.
+ *
+ * The codec parameters found by avformat_find_stream_info() are saved
+ * in the cache directory, one file per input URL, which is named and
+ * identified by the hash of the URL only. On the next start,
+ * they populate the streams of the opened input, so that only a tiny
+ * probe on the first packets is needed to validate them.
+ */
+
+/*
+ * populate the streams of the opened input ic with the cached parameters,
+ * only the parameters unknown to the demuxer are filled.
+ * return 1 if populated, 0 if no usable cache, 
+ * a negative AVERROR if the cache mismatches the demuxer, which is removed
+ */
+int probe_cache_load(const char *dir, AVFormatContext *ic);
+
+/*
+ * save the stream parameters of ic to the cache,
+ * return 1 if the cache is changed, 0 if the same, a negative AVERROR on failure
+ */
+int probe_cache_save(const char *dir, AVFormatContext *ic);
+
+void probe_cache_remove(const char *dir, const char *url);
+
+#endif /* IVR_PROBE_CACHE_H */
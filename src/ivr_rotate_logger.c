@@ -25,25 +25,63 @@
 #include <libavutil/avutil.h>   
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
-
-#if HAVE_LIBPTHREAD
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
 #include <pthread.h>
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
+#include <semaphore.h>
 
+/*
+ * The logger callback only formats the line into a slot of a bounded
+ * MPSC ring (Vyukov's per-slot sequence queue), the file IO including
+ * the time prefix, repeat suppression and rotation is done by a
+ * background flusher thread which writes the lines in batches with writev().
+ * If the ring is full, the line is dropped and counted instead of
+ * blocking the caller.
+ */
 
 #define MAX_FILE_PATH 2048
 static char g_base_name[MAX_FILE_PATH];
 static int g_file_size = 0;
 static int g_rotate_num = 0;
 static int g_fd = -1;
+static int64_t g_cur_size = 0;     // size of the current log file, instead of lseek()
+static int g_time_format = ROTATE_LOGGER_TIME_CTIME;
 
 
 #define LINE_SZ 1024
+#define RING_SIZE 1024      // must be power of 2
+#define RING_MASK (RING_SIZE - 1)
+#define BATCH_SIZE 64       // max records written by one writev()
+#define TIME_STR_SZ 48
+#define REPEAT_STR_SZ 64
+
+typedef struct LogRecord {
+    volatile uint32_t sequence;
+    int print_prefix;  // the line should be prefixed with time
+    struct timespec time;
+    char line[LINE_SZ];
+} LogRecord;
+
+static LogRecord g_ring[RING_SIZE];
+static uint32_t g_enqueue_pos = 0;
+static uint32_t g_dequeue_pos = 0;   // only accessed by the flusher
+static volatile uint32_t g_dropped = 0;
 
-static void print_time(void);
-static void print_to_log(const char* line);
+static pthread_t g_flusher_id;
+static sem_t g_wakeup;
+static volatile int g_running = 0;
+static volatile int g_flusher_sleeping = 0;
+static volatile int g_rotate_requested = 0;
+
+static void * flusher_routine(void *arg);
+static void wakeup_flusher(void);
+static int flush_records(void);
 static void check_rotate_internal(void);
 static int open_log_file(void);
 static void shift_log_file(void);
@@ -53,86 +91,239 @@ static void close_log_file(void);
 
 void av_rotate_logger_callback(void* ptr, int level, const char* fmt, va_list vl)
 {
-    static int print_prefix = 1;
-    static int count;
-    static char prev[LINE_SZ];
-    char line[LINE_SZ];
-    unsigned tint = 0;
+    static __thread int print_prefix = 1;
+    LogRecord *rec;
+    uint32_t pos;
 
     if (level >= 0) {
-        tint = level & 0xff00;
         level &= 0xff;
     }
 
     if (level > av_log_get_level())
         return;
     
-    if(level < 0){
+    if(level < 0 || !g_running){
         //no output
         return;
     }
-#if HAVE_PTHREADS
-    pthread_mutex_lock(&mutex);
-#endif
-      
-    av_log_format_line(ptr, level, fmt, vl, line, sizeof(line), &print_prefix);
     
-    if (print_prefix && (av_log_get_flags() & AV_LOG_SKIP_REPEATED) && !strcmp(line, prev) &&
-        *line && line[strlen(line) - 1] != '\r'){
-        count++;
-        goto end;
+    //claim a slot
+    pos = __atomic_load_n(&g_enqueue_pos, __ATOMIC_RELAXED);
+    for(;;){
+        int32_t diff;
+        rec = &g_ring[pos & RING_MASK];
+        diff = (int32_t)(__atomic_load_n(&rec->sequence, __ATOMIC_ACQUIRE) - pos);
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&g_enqueue_pos, &pos, pos + 1, 1, 
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                break;
+            }
+        }else if(diff < 0){
+            //ring is full
+            __sync_fetch_and_add(&g_dropped, 1);
+            wakeup_flusher();
+            return;
+        }else{
+            pos = __atomic_load_n(&g_enqueue_pos, __ATOMIC_RELAXED);
+        }
     }
-    if(print_prefix){        
-        print_time();
-    }      
-    if (count > 0) {
-        char repeat_line[LINE_SZ];
-        sprintf(repeat_line, "    Last message repeated %d times\n", count);        
-        count = 0;
-        print_to_log(repeat_line);
-        if(print_prefix){        
-            print_time();
-        }         
+    
+    av_log_format_line(ptr, level, fmt, vl, rec->line, sizeof(rec->line), &print_prefix);
+    rec->print_prefix = print_prefix;
+    clock_gettime(CLOCK_REALTIME, &rec->time);
+    
+    //publish the record to the flusher
+    __atomic_store_n(&rec->sequence, pos + 1, __ATOMIC_RELEASE);
+    
+    wakeup_flusher();
+}
+
+static void wakeup_flusher(void)
+{
+    if(__atomic_load_n(&g_flusher_sleeping, __ATOMIC_SEQ_CST) &&
+       __atomic_exchange_n(&g_flusher_sleeping, 0, __ATOMIC_SEQ_CST)){
+        sem_post(&g_wakeup);
     }
-    strcpy(prev, line);
-    print_to_log(line);
+}
+
+static int has_pending_record(void)
+{
+    LogRecord *rec = &g_ring[g_dequeue_pos & RING_MASK];
+    return __atomic_load_n(&rec->sequence, __ATOMIC_ACQUIRE) == g_dequeue_pos + 1 ||
+           __atomic_load_n(&g_dropped, __ATOMIC_RELAXED) != 0 || 
+           g_rotate_requested;
+}
+
+static void * flusher_routine(void *arg)
+{
+    for(;;){
+        while(flush_records() > 0);
+        
+        if(!__atomic_load_n(&g_running, __ATOMIC_SEQ_CST)){
+            break;
+        }
+        
+        //going to sleep, but check again to avoid missing a wakeup
+        __atomic_store_n(&g_flusher_sleeping, 1, __ATOMIC_SEQ_CST);
+        if(has_pending_record() || !__atomic_load_n(&g_running, __ATOMIC_SEQ_CST)){
+            if(!__atomic_exchange_n(&g_flusher_sleeping, 0, __ATOMIC_SEQ_CST)){
+                //a producer has posted, consume it
+                sem_wait(&g_wakeup);
+            }
+            continue;
+        }
+        while(sem_wait(&g_wakeup) < 0 && errno == EINTR);
+    }
+    
+    //drain the remaining records
+    while(flush_records() > 0);
     
-end:
-#if HAVE_PTHREADS
-    pthread_mutex_unlock(&mutex);
-#endif    
+    return NULL;
 }
 
-static void print_time(void)
+/* 
+ * build the time prefix into time_str_buf, return its length. 
+ * The second-resolution part is cached and only rebuilt when the second changes.
+ */
+static int print_time(const struct timespec *ts, char * time_str_buf)
 {
-    char time_str_buf[48];
-    time_t curtime = time (NULL);
-    char *time_str;    
+    static time_t cached_sec = (time_t)-1;
+    static char cached_str[TIME_STR_SZ];
+    static int cached_len = 0;
+    static char tz_str[8];
+    static int tz_len = 0;
+    char *p = time_str_buf;
+    int ms;
     
-    memset(time_str_buf, 0, sizeof(time_str_buf));
-    time_str_buf[0] = '[';
-    time_str = ctime_r(&curtime, time_str_buf+1);    
-    time_str_buf[strlen(time_str_buf) - 1] = ']'; //remove the end NEWLINE char
-    time_str_buf[strlen(time_str_buf)] = ' ';
-    time_str_buf[strlen(time_str_buf) +1] = 0;       
+    if(ts->tv_sec != cached_sec){
+        struct tm tm;
+        localtime_r(&ts->tv_sec, &tm);
+        cached_str[0] = '[';
+        if(g_time_format == ROTATE_LOGGER_TIME_CTIME){
+            asctime_r(&tm, cached_str + 1);
+            cached_len = 1 + 24;    //asctime has a fixed length of 24 without the NEWLINE char
+            cached_str[cached_len++] = ']';
+            cached_str[cached_len++] = ' ';
+        }else{
+            cached_len = 1 + strftime(cached_str + 1, TIME_STR_SZ - 1,
+                                      g_time_format == ROTATE_LOGGER_TIME_ISO8601 ? 
+                                      "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d %H:%M:%S",
+                                      &tm);
+            tz_len = g_time_format == ROTATE_LOGGER_TIME_ISO8601 ? 
+                     strftime(tz_str, sizeof(tz_str), "%z", &tm) : 0;
+        }
+        cached_sec = ts->tv_sec;
+    }
     
-    check_rotate_internal();  
-      
-    if(g_fd >= 0){
-        write(g_fd, time_str_buf, strlen(time_str_buf));      
-    }        
+    memcpy(p, cached_str, cached_len);
+    p += cached_len;
+    if(g_time_format != ROTATE_LOGGER_TIME_CTIME){
+        ms = ts->tv_nsec / 1000000;
+        *p++ = '.';
+        *p++ = '0' + ms / 100;
+        *p++ = '0' + ms / 10 % 10;
+        *p++ = '0' + ms % 10;
+        memcpy(p, tz_str, tz_len);
+        p += tz_len;
+        *p++ = ']';
+        *p++ = ' ';
+    }
+    return p - time_str_buf;
 }
-static void print_to_log(const char* line)
+
+/* write out a batch of records, return the number of records consumed */
+static int flush_records(void)
 {
-    if(g_fd >= 0){
-        write(g_fd, line, strlen(line));            
+    static int count = 0;
+    static char prev[LINE_SZ];
+    static char time_bufs[BATCH_SIZE][TIME_STR_SZ];
+    static char repeat_bufs[BATCH_SIZE + 1][REPEAT_STR_SZ];
+    struct iovec iov[BATCH_SIZE * 4 + 1];
+    int iov_num = 0, time_num = 0, repeat_num = 0;
+    int rec_num = 0, i;
+    uint32_t dropped;
+    ssize_t written;
+    
+    if(g_rotate_requested){
+        g_rotate_requested = 0;
+        check_rotate_internal();
+    }
+    
+    dropped = __atomic_exchange_n(&g_dropped, 0, __ATOMIC_RELAXED);
+    if(dropped){
+        snprintf(repeat_bufs[repeat_num], REPEAT_STR_SZ, 
+                 "    %u log messages dropped\n", dropped);
+        iov[iov_num].iov_base = repeat_bufs[repeat_num];
+        iov[iov_num].iov_len = strlen(repeat_bufs[repeat_num]);
+        iov_num++;
+        repeat_num++;
     }
+    
+    while(rec_num < BATCH_SIZE){
+        LogRecord *rec = &g_ring[(g_dequeue_pos + rec_num) & RING_MASK];
+        if(__atomic_load_n(&rec->sequence, __ATOMIC_ACQUIRE) != g_dequeue_pos + rec_num + 1){
+            break;  //not published yet
+        }
+        rec_num++;
+        
+        if (rec->print_prefix && (av_log_get_flags() & AV_LOG_SKIP_REPEATED) && 
+            !strcmp(rec->line, prev) &&
+            rec->line[0] && rec->line[strlen(rec->line) - 1] != '\r'){
+            count++;
+            continue;
+        }
+        if(rec->print_prefix){
+            iov[iov_num].iov_base = time_bufs[time_num];
+            iov[iov_num].iov_len = print_time(&rec->time, time_bufs[time_num]);
+            iov_num++;
+            time_num++;
+        }
+        if (count > 0) {
+            snprintf(repeat_bufs[repeat_num], REPEAT_STR_SZ, 
+                     "    Last message repeated %d times\n", count);
+            count = 0;
+            iov[iov_num].iov_base = repeat_bufs[repeat_num];
+            iov[iov_num].iov_len = strlen(repeat_bufs[repeat_num]);
+            iov_num++;
+            repeat_num++;
+            if(rec->print_prefix){
+                iov[iov_num] = iov[iov_num - 2];
+                iov_num++;
+            }
+        }
+        strcpy(prev, rec->line);
+        iov[iov_num].iov_base = rec->line;
+        iov[iov_num].iov_len = strlen(rec->line);
+        iov_num++;
+    }
+    
+    if(iov_num > 0 && g_fd >= 0){
+        check_rotate_internal();
+        if(g_fd >= 0){
+            written = writev(g_fd, iov, iov_num);
+            if(written > 0){
+                g_cur_size += written;
+            }
+        }
+    }
+    
+    //release the slots to the producers
+    for(i = 0; i < rec_num; i++){
+        LogRecord *rec = &g_ring[g_dequeue_pos & RING_MASK];
+        __atomic_store_n(&rec->sequence, g_dequeue_pos + RING_SIZE, __ATOMIC_RELEASE);
+        g_dequeue_pos++;
+    }
+    
+    return rec_num;
 }
 
 
 int rotate_logger_init(char * base_name, 
-                       int file_size, int rotate_num)
+                       int file_size, int rotate_num, 
+                       int time_format)
 {
+    uint32_t i;
+    
     if(base_name == NULL || strlen(base_name) == 0 ||
        strlen(base_name) >= MAX_FILE_PATH){
         return -1;
@@ -147,12 +338,44 @@ int rotate_logger_init(char * base_name,
     g_base_name[LINE_SZ - 1] = 0;
     g_file_size = file_size;
     g_rotate_num = rotate_num;
+    g_time_format = time_format;
+    
+    if(open_log_file()){
+        return -1;
+    }
+    
+    for(i = 0; i < RING_SIZE; i++){
+        g_ring[i].sequence = i;
+    }
+    g_enqueue_pos = g_dequeue_pos = 0;
+    g_dropped = 0;
+    
+    if(sem_init(&g_wakeup, 0, 0)){
+        perror("Init log semaphore failed"); 
+        close_log_file();
+        return -1;
+    }
+    g_running = 1;
+    if(pthread_create(&g_flusher_id, NULL, flusher_routine, NULL)){
+        perror("Create log flusher thread failed"); 
+        g_running = 0;
+        sem_destroy(&g_wakeup);
+        close_log_file();
+        return -1;
+    }
     
-    return open_log_file();
-                           
+    return 0;
 }
 void rotate_logger_uninit(void)
 {
+    if(!g_running){
+        return;
+    }
+    __atomic_store_n(&g_running, 0, __ATOMIC_SEQ_CST);
+    sem_post(&g_wakeup);
+    pthread_join(g_flusher_id, NULL);
+    sem_destroy(&g_wakeup);
+    
     close_log_file();
 }
 
@@ -160,22 +383,14 @@ void rotate_logger_uninit(void)
 
 void check_rotate(void)
 {
-    
-#if HAVE_PTHREADS
-    pthread_mutex_lock(&mutex);
-#endif
-    
-    if(g_fd < 0){
+    if(!g_running){
         perror("log rotate module is not init");         
-        goto end;
+        return;
     }
     
-    check_rotate_internal();
-    
-end:    
-#if HAVE_PTHREADS
-    pthread_mutex_unlock(&mutex);
-#endif    
+    //rotation is done by the flusher
+    g_rotate_requested = 1;
+    wakeup_flusher();
 }
 
 static void check_rotate_internal(void)
@@ -190,7 +405,7 @@ static void check_rotate_internal(void)
 
 static int open_log_file(void)
 {
-    int ret;
+    off_t len;
     
     int fd = open(g_base_name, 
                   O_CREAT|O_WRONLY|O_APPEND|O_CLOEXEC, 0777);                
@@ -199,9 +414,10 @@ static int open_log_file(void)
         perror("Open log file failed"); 
         return -1;
     }
-    lseek(fd, 0, SEEK_END);
+    len = lseek(fd, 0, SEEK_END);
     
     g_fd = fd;
+    g_cur_size = len > 0 ? len : 0;
     
     return 0;
 }
@@ -260,17 +476,10 @@ static void shift_log_file(void)
 
 static int is_too_large(void)
 {
-    off_t len = 0;
     if(g_fd < 0){
         // no open log file
         return 0;
     }
-    
-    len = lseek(g_fd, 0, SEEK_CUR);
-    if (len < 0) {
-        return 0;
-    }
 
-    return (len >= g_file_size);
-  
-}
\ No newline at end of file
+    return (g_cur_size >= g_file_size);
+}
@@ -24,10 +24,18 @@
 
 #include <stdarg.h>
 
+/* format of the time prefix of each log line */
+enum RotateLoggerTimeFormat {
+    ROTATE_LOGGER_TIME_CTIME = 0,   // [Mon Oct 19 00:22:46 2026]
+    ROTATE_LOGGER_TIME_MS,          // [2026-10-19 00:22:46.123]
+    ROTATE_LOGGER_TIME_ISO8601,     // [2026-10-19T00:22:46.123+0800]
+};
+
 void av_rotate_logger_callback(void* ptr, int level, const char* fmt, va_list vl);
 
 int rotate_logger_init(char *base_name, 
-                       int file_size, int file_num);
+                       int file_size, int file_num, 
+                       int time_format);
                        
 void rotate_logger_uninit(void);
 